@@ -1,8 +1,20 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+#ifndef PLATFORM_WEB
+#include <pthread.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#define HAVE_THREADS
+#endif
 
 #include <gsl/gsl_errno.h>
+#include <gsl/gsl_fft_complex.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_odeiv2.h>
 #include <gsl/gsl_randist.h>
@@ -28,18 +40,310 @@ typedef struct {
 } VTail;
 
 typedef struct {
-  VState state;
   Color color;
   VTail *tail;
 } Planet;
 
 typedef struct {
+  double cx, cy, h; // cell center and half width
+  double mx, my;    // center of mass
+  int count;        // number of bodies below this node
+  int child;        // index of the first of 4 children, -1 for leaves
+  int body;         // first body of a leaf, chained through BHTree.next
+} BHNode;
+
+typedef struct {
+  int n;   // nodes in use
+  int cap; // nodes allocated
+  BHNode *nodes;
+  int *next; // next body in the same leaf, -1 terminates
+} BHTree;
+
+typedef struct {
+  int levels;       // leaf level L: 2^L x 2^L leaf cells
+  int order;        // expansion order p
+  int nterms;       // coefficients per expansion, (p+1)(p+2)/2
+  double x0, y0, w; // lower left corner and width of the root cell
+  int ncells;       // cells over all levels
+  double *M, *L;    // multipole and local expansions, nterms per cell
+  double *K;        // M2L operators for the 7x7 cell offsets of one level
+  int *start;       // first body of each leaf in perm, 4^L + 1 entries
+  int *leaf;        // leaf of each body
+  int *perm;        // bodies sorted by leaf
+} FMM;
+
+typedef struct {
+  int nx, ny;       // nx x ny cells
+  double x0, y0;    // lower left corner of the grid
+  double cw, ch;    // cell width and height, at least the cutoff
+  int torus;        // grid spans one period lx x ly and wraps around
+  double lx, ly;
+  double rc2;       // squared cutoff
+  double alpha;     // > 0: only the erfc(alpha r) part of P3M interacts
+  int cap, ncap;    // bodies and cells the arrays below can hold
+  int *cell;        // cell of each body
+  int *start;       // first body of each cell in perm, nx ny + 1 entries
+  int *perm;        // bodies sorted by cell
+  double *sx, *sy;  // positions in perm order
+} CellList;
+
+typedef struct {
+  CellList cells;   // grid at cutoff + skin, sorted at the last rebuild
+  int n;            // bodies at the last rebuild, 0: none yet
+  double rc, skin;  // cutoff and skin at the last rebuild
+  double *x0, *y0;  // positions at the last rebuild
+  int *start;       // neighbors of sorted body k: nbr[start[k] .. start[k+1]]
+  int *nbr;
+  int nbr_cap;
+  int rebuilds;     // statistics: list rebuilds and force evaluations
+  int evals;
+} VerletList;
+
+typedef struct {
+  int gx, gy;       // periodic mesh of gx x gy nodes, powers of two
+  double lx, ly;    // period
+  double hx, hy;    // mesh spacing
+  int size;         // nodes the mesh can hold
+  double *mesh;     // complex values, node (ix, iy) at 2 (iy gx + ix)
+} PM;
+
+typedef struct {
+  double lx, ly;    // period the tables were made for
+  double tol;       // relative tolerance
+  double alpha;     // splitting parameter
+  double rc;        // real-space cutoff
+  int mx, my;       // k = 2 pi (m / lx, l / ly) for |m| <= mx, |l| <= my
+  int nk;           // k vectors in the half plane within the cutoff
+  int *km, *kl;     // their m and l
+  double *kw;       // and weights 2 (2 pi / A) erfc(k / 2 alpha) / k
+  int cap;          // bodies the tables below can hold
+  double *ex, *ey;  // e^(i 2 pi m x / lx), m = 0..mx, and l = -my..my, per body
+  double *sk;       // structure factors sum_j e^(i k x_j), complex, per k
+} Ewald;
+
+// State layouts: interleaved VState records, or separate x[], y[], vx[], vy[]
+// arrays of cap values each (in that order). Slots past n are zero.
+enum { PS_AOS, PS_SOA };
+
+// Cost of PSystem_step: RHS evaluations and wall time of the last step, and
+// the worst step of the last full window of FPS steps
+typedef struct {
+  int evals;         // RHS evaluations so far
+  int jacobians;     // Jacobian evaluations so far
+  int rejected;      // steps rejected by the error control so far
+  int step_evals;
+  int step_rejected;
+  double step_time;
+  int worst_evals;
+  double worst_time;
+  int window_steps;  // steps of the current window and their worst
+  int window_evals;
+  double window_time;
+} StepStats;
+
+typedef struct {
+  int dim;       // state size the buffers hold
+  double h;      // substep, adapted across frames
+  double hp;     // previous substep, 0 if there is no history
+  double *buf;   // state vectors and the Krylov basis
+  int steps;     // statistics: accepted and failed substeps, Newton and
+  int failed;    // GMRES iterations
+  int newton;
+  int krylov;
+} JFNK;
+
+// Dormand-Prince 5(4) with step size control
+typedef struct {
+  int dim;        // state size buf holds
+  double *buf;    // slopes k2..k7, stage state and solution
+  double h;       // step, adapted across frames
+  double err;     // error of the last accepted step, for the PI controller
+  int rejected;   // the last step was rejected
+  long steps;     // statistics: accepted and rejected steps
+  long failed;
+} DOPRI5;
+
+#define ABM_ORDER 8 // highest order of the Adams-Bashforth predictor
+#define ABM_START 4 // slopes of the history started with rk4 steps
+
+// Adams-Bashforth-Moulton predictor-corrector with variable order
+typedef struct {
+  int dim;                  // state size buf holds
+  double *buf;              // slope history, predicted state and slope,
+                            // rk4 sum
+  double *f[ABM_ORDER + 1]; // slope history at steps h apart, newest first
+  int m;                    // slopes in the history
+  int order;                // order k of the predictor, k + 1 corrects
+  double h;                 // step of the history
+  long steps;               // statistics: steps, restarts and the sum of
+  long restarts;            // the orders
+  long orders;
+} ABM;
+
+// Fixed-step Runge-Kutta workspace
+typedef struct {
+  int dim;     // state size buf holds
+  double *buf; // sum of the stages, stage state and slope
+} FixedRK;
+
+// Hermite integrator with block time steps: body i is at tick t[i] of the
+// frame and steps by dt[i] ticks, a power of two
+typedef struct {
+  int size;                   // bodies the arrays can hold
+  double *ax, *ay, *jx, *jy;  // acceleration and jerk at t[i]
+  double *px, *py, *pvx, *pvy; // state predicted to the current block time
+  int *t, *dt;
+  int nact, *act;             // bodies stepping at the current block time
+  double *na, *nj;            // their new acceleration and jerk, 2 per body
+  int shared;                 // force the smallest step on every body
+  long forces;                // statistics: body force evaluations and
+  long steps;                 // body steps
+} Hermite;
+
+typedef struct PSystem PSystem;
+
+// Right hand side for gsl_odeiv2_system, params is the PSystem
+typedef int (*RHSFunc)(double t, const double y[], double dydt[],
+                       void *params);
+// Adds C times the pairwise interactions at x, y to ax, ay
+typedef void (*InteractFunc)(PSystem *ps, const double *x, const double *y,
+                             double *ax, double *ay, double C);
+
+// Forces of the native steppers: func() at the current state, kept across
+// steps and frames until the state or the force law changes
+typedef struct {
+  int size;               // bodies f can hold
+  double *f;              // func() at ps->state, in its layout
+  int dirty;              // f is stale, or the state changed outside the
+                          // stepper
+  double M, C, E2;        // settings f was evaluated with
+  InteractFunc interact;
+  int param, topology, width, height, stepper;
+} Kick;
+
+struct PSystem {
   int n;
-  Planet **planets;
-  VState *state;
+  int cap;       // bodies state and the driver can hold
+  int layout;
+  double *state; // 4 cap values, see PSystem_view
   gsl_odeiv2_system *sys;
   gsl_odeiv2_driver *driver;
-} PSystem;
+  int driver_n;  // bodies at the last driver step
+  double time;   // simulation clock
+  int cold;      // bench: 1 gsl_odeiv2_driver_apply from t = 0 per frame,
+                 // 2 also from the initial step size
+  BHTree bh;
+  FMM fmm;
+  CellList cells;
+  VerletList verlet;
+  PM pm;
+  Ewald ewald;
+  int scratch;            // bodies the scratch arrays below can hold
+  double *px, *py;        // packed positions
+  double *pax, *pay;      // packed accelerations
+  int acc_size;
+  double *acc;            // per-thread force accumulators
+  double M, C;            // gravity and interaction of the frame
+  double E2;              // squared softening length of the frame
+  RHSFunc rhs;            // specialized func(), see PSystem_select
+  InteractFunc interact;  // FORCE engine
+  StepStats stats;
+  int stepper;            // STEPPER this system integrates with
+  JFNK jfnk;
+  FixedRK rk;
+  DOPRI5 dopri;
+  ABM abm;
+  Kick kick;
+  Hermite hermite;
+};
+
+// Changes to the system requested by the UI, applied by the physics thread
+// between steps
+enum {
+  CMD_ADD,     // add body s
+  CMD_SPAWN,   // add a random body, as KEY_S
+  CMD_RESET,   // remove all bodies
+  CMD_FREEZE,  // scale velocities by 0.9
+  CMD_SHOCK,   // random velocity kicks
+  CMD_CENTER,  // move to the center of mass frame
+  CMD_STEPPER, // integrate with stepper arg
+};
+
+typedef struct {
+  int type;
+  int arg;
+  VState s;
+} Command;
+
+// What the render thread sees of the system after one physics step
+typedef struct {
+  int n;
+  int size;            // positions pos and prev can hold
+  Vector2 *pos;
+  Vector2 *prev;       // positions one step earlier
+  int generation;      // incremented by every CMD_RESET
+  unsigned long steps; // physics steps so far
+  long dropped;        // steps skipped to stay within SIM_MAX_TICKS
+  double time;         // simulation clock
+  double wall;         // wall time the state is due at, see Sim_advance
+  double energy;       // total energy, kinetic only if kinetic is set
+  int kinetic;
+  StepStats stats;
+  int stepper, threads;
+  int rebuilds, evals; // Verlet list statistics
+  double rate;         // physics steps per wall second
+} Snapshot;
+
+#define SIM_FRESH 4 // bit of Sim.middle: the slot holds an unread snapshot
+
+// Settings the UI changes. The globals of these names belong to the thread
+// that steps the system; the render thread edits its own copy, UI, and
+// hands it over with Sim_configure.
+#define SETTINGS(X)                                                          \
+  X(GRAVITY) X(INTERACTION) X(SCALE) X(TOPOLOGY) X(LAYOUT) X(STEPPER)        \
+  X(SUBSTEPS) X(FORCE) X(THETA) X(FMM_ORDER) X(CUTOFF) X(SKIN) X(PM_GRID)    \
+  X(P3M_SPLIT) X(EWALD_DIGITS) X(THREADS) X(SOFTENING) X(screenWidth)        \
+  X(screenHeight)
+
+typedef struct {
+#define X(name) int name;
+  SETTINGS(X)
+#undef X
+} Settings;
+
+// Physics thread and its triple buffer of snapshots. The writer owns slot
+// back and the reader slot front; middle is swapped atomically by both.
+typedef struct {
+  Snapshot slots[3];
+  int back, middle, front;
+  PSystem *ps; // physics thread only
+  int generation;
+  unsigned long steps;
+  double clock; // wall time the simulation has been advanced to
+  long dropped;
+  int last_n, last_size; // positions of the last snapshot
+  Vector2 *last;
+  double rate, rate_time; // steps per second, measured since rate_time
+  unsigned long rate_steps;
+  Command *cmds; // queued by the UI, under lock
+  int ncmds, cmd_cap;
+  Settings settings; // for the next step, under lock
+  int configured;    // settings is newer than the globals
+  int quit;
+#ifdef HAVE_THREADS
+  pthread_mutex_t lock;
+  pthread_t thread;
+#endif
+} Sim;
+
+// Render thread side of the bodies: a planet with its tail per body of the
+// snapshots
+typedef struct {
+  int n, cap;
+  Planet **planets;
+  int generation;      // of the snapshot the planets belong to
+  unsigned long steps; // snapshot the tails were last pushed from
+} Scene;
 
 // Screen Coordinate System with letters P,Q,..
 int screenWidth = 1600;
@@ -47,334 +351,4411 @@ int screenHeight = 900;
 gsl_rng *rng;
 
 const int FPS = 60;
-const float STEP = 5.0f / (float)FPS;
+const float STEP = 5.0f / (float)FPS; // simulation time per physics step
+const double TICK = 1.0 / FPS;        // wall seconds per physics step
+#define SIM_MAX_TICKS 5 // physics steps one Sim_advance may catch up
 
 int GRAVITY = 0; // size of sun
 int INTERACTION = 0;
 int SCALE = 0;
 int TOPOLOGY = 0; // 0: rectangle / 1: torus
+int LAYOUT = PS_AOS;
 
-// Evaluate function at time t, state y and store result in dydt
-int func(double t, const double y[], double dydt[], void *params) {
-  (void)(t); /* avoid unused parameter warning */
-  PSystem *ps = (PSystem *)params;
+// Integrators: GSL steppers (bsimp and msbdf use the Jacobian), the
+// Jacobian-free Newton-Krylov trapezoidal rule, native symplectic
+// splittings, Hermite block steps, fixed-step Runge-Kutta, Dormand-Prince
+// and Adams-Bashforth-Moulton
+enum {
+  STEP_RK4,
+  STEP_RKF45,
+  STEP_RK8PD,
+  STEP_BSIMP,
+  STEP_MSBDF,
+  STEP_JFNK,
+  STEP_LEAPFROG,
+  STEP_YOSHIDA4,
+  STEP_YOSHIDA6,
+  STEP_FOREST_RUTH,
+  STEP_PEFRL,
+  STEP_HERMITE,
+  STEP_RK2_FIXED,
+  STEP_RK4_FIXED,
+  STEP_DOPRI5,
+  STEP_ABM,
+  STEP_ABM_PEC,
+  STEPPERS
+};
+const char *STEPPER_NAMES[] = {"rk4",      "rkf45",    "rk8pd",
+                               "bsimp",    "msbdf",    "jfnk",
+                               "leapfrog", "yoshida4", "yoshida6",
+                               "forest-ruth", "pefrl",    "hermite",
+                               "rk2-fixed", "rk4-fixed", "dopri5",
+                               "abm",      "abm-pec"};
+int STEPPER = STEP_RK4;
+int SUBSTEPS = 16; // fixed steps per frame of the native steppers
+
+// Engines for the pairwise INTERACTION forces
+enum {
+  FORCE_DIRECT,
+  FORCE_SIMD,
+  FORCE_TILED,
+  FORCE_BARNES_HUT,
+  FORCE_FMM,
+  FORCE_CELLS,
+  FORCE_VERLET,
+  FORCE_PM,
+  FORCE_P3M,
+  FORCE_EWALD,
+  FORCE_MODES
+};
+const char *FORCE_NAMES[] = {"direct", "direct-simd", "direct-tiled",
+                             "barnes-hut", "fmm", "cell-list", "verlet",
+                             "particle-mesh", "p3m", "ewald"};
+int FORCE = FORCE_DIRECT;
+int THETA = 50;    // Barnes-Hut opening angle in percent
+int FMM_ORDER = 6; // FMM expansion order
+int CUTOFF = 50;   // cell-list cutoff radius in 1/100 simulation units
+int SKIN = 10;     // Verlet list skin in 1/100 simulation units
+int PM_GRID = 7;   // particle-mesh nodes along the width: 2^PM_GRID
+int P3M_SPLIT = 40; // P3M split radius in 1/100 simulation units
+int EWALD_DIGITS = 6; // Ewald tolerance 10^-EWALD_DIGITS
+int THREADS = 0;   // force evaluation threads, 0: one per CPU
+int SOFTENING = 0; // Plummer softening length in 1/100 simulation units
+
+Settings UI; // render thread's copy of the settings
+
+void Settings_get(Settings *s) {
+#define X(name) s->name = name;
+  SETTINGS(X)
+#undef X
+}
+
+void Settings_set(const Settings *s) {
+#define X(name) name = s->name;
+  SETTINGS(X)
+#undef X
+}
+
+double wall_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// 1/r^3 of a pair; pairs closer than r3 = 1e-6 do not interact. Kernels
+// pass r^2 + eps^2 for Plummer softening with length eps, which keeps the
+// force below 0.4 / eps^2 in close encounters.
+static inline double inv_r3(double r2) {
+  double r3 = r2 * sqrt(r2);
+  return r3 > 1e-6 ? 1.0 / r3 : 0.0;
+}
+
+//
+// Thread pool
+//
+// Workers sleep on a condition variable and run one task per Pool_run; the
+// calling thread takes part as thread 0. Without pthreads (web build) tasks
+// run inline on one thread.
+//
+
+typedef void (*PoolTask)(void *arg, int tid, int nthreads);
+
+typedef struct {
+  int size; // worker threads besides the caller
+#ifdef HAVE_THREADS
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  unsigned long round; // incremented by every Pool_run
+  unsigned long start; // round when the workers were created
+  int busy;            // workers still running the current round
+  int next_tid;
+#endif
+  PoolTask task;
+  void *arg;
+  int nthreads;
+} Pool;
+
+Pool pool;
+
+#ifdef HAVE_THREADS
+void *Pool_worker(void *arg) {
+  (void)(arg);
+  pthread_mutex_lock(&pool.lock);
+  int tid = ++pool.next_tid;
+  unsigned long seen = pool.start; // a Pool_run may already have begun
+  for (;;) {
+    while (pool.round == seen) {
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    seen = pool.round;
+    PoolTask task = pool.task;
+    void *task_arg = pool.arg;
+    int nthreads = pool.nthreads;
+    pthread_mutex_unlock(&pool.lock);
+    if (tid < nthreads) {
+      task(task_arg, tid, nthreads);
+    }
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.busy == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  return NULL;
+}
+#endif
+
+// Threads a Pool_run uses: THREADS, or one per CPU
+int Pool_threads() {
+#ifdef HAVE_THREADS
+  if (!pool.threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.size = (cpus > 1 ? cpus : 1) - 1;
+    pool.threads = calloc(pool.size + 1, sizeof(pthread_t));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_mutex_lock(&pool.lock);
+    pool.start = pool.round;
+    pthread_mutex_unlock(&pool.lock);
+    for (int t = 0; t < pool.size; t++) {
+      pthread_create(&pool.threads[t], NULL, Pool_worker, NULL);
+    }
+  }
+#endif
+  int n = THREADS > 0 ? THREADS : pool.size + 1;
+  return n < pool.size + 1 ? n : pool.size + 1;
+}
+
+// Run task on nthreads threads, at most Pool_threads(); callers that size
+// buffers by the thread count pass the count they sized them for
+void Pool_run(PoolTask task, void *arg, int nthreads) {
+  if (nthreads <= 1) {
+    task(arg, 0, 1);
+    return;
+  }
+#ifdef HAVE_THREADS
+  pthread_mutex_lock(&pool.lock);
+  pool.task = task;
+  pool.arg = arg;
+  pool.nthreads = nthreads;
+  pool.busy = pool.size;
+  pool.round++;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  task(arg, 0, nthreads);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.busy) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+#endif
+}
+
+// Arguments of a parallel force pass; rows are handed out in chunks
+typedef struct {
+  PSystem *ps;
+  const double *x, *y;
+  double *ax, *ay;
+  double C;
+  int next;     // first row not yet taken
+  int nthreads; // threads of the pass
+} ForceTask;
+
+#define FORCE_CHUNK 64
+
+// Take the next chunk of rows, returns 0 when all are done
+int ForceTask_rows(ForceTask *ft, int *i0, int *i1) {
+  *i0 = __atomic_fetch_add(&ft->next, FORCE_CHUNK, __ATOMIC_RELAXED);
+  *i1 = *i0 + FORCE_CHUNK < ft->ps->n ? *i0 + FORCE_CHUNK : ft->ps->n;
+  return *i0 < ft->ps->n;
+}
+
+void Pool_force(PoolTask task, PSystem *ps, const double *x, const double *y,
+                double *ax, double *ay, double C) {
+  ForceTask ft = {ps, x, y, ax, ay, C, 0, Pool_threads()};
+  Pool_run(task, &ft, ft.nthreads);
+}
+
+// Row i0 <= i < i1 of the pair triangle j < i: row 1 + 2 + ... + i pairs
+// are split evenly, so thread t starts at n sqrt(t / T)
+int direct_split(int n, int t, int nthreads) {
+  return t >= nthreads ? n : (int)(n * sqrt((double)t / nthreads));
+}
+
+// Symmetric pair sweep; every thread accumulates into its own buffers,
+// which are summed in a second pass
+void direct_task(void *arg, int tid, int nthreads) {
+  ForceTask *ft = arg;
+  PSystem *ps = ft->ps;
+  int n = ps->n;
+  const double *x = ft->x, *y = ft->y;
+  int i0 = direct_split(n, tid, nthreads), i1 = direct_split(n, tid + 1, nthreads);
+  double *ax = ps->acc + 2 * (size_t)n * tid, *ay = ax + n, e2 = ps->E2;
+  memset(ax, 0, sizeof(double) * 2 * n);
+  for (int i = i0; i < i1; i++) {
+    double fx = 0, fy = 0;
+    for (int j = 0; j < i; j++) {
+      double dx = x[j] - x[i]; // from i -> j
+      double dy = y[j] - y[i];
+      double f = inv_r3(dx * dx + dy * dy + e2);
+      fx += dx * f;
+      fy += dy * f;
+      ax[j] -= dx * f;
+      ay[j] -= dy * f;
+    }
+    ax[i] += fx;
+    ay[i] += fy;
+  }
+}
+
+void direct_reduce(void *arg, int tid, int nthreads) {
+  ForceTask *ft = arg;
+  PSystem *ps = ft->ps;
+  int n = ps->n;
+  for (int i = n * tid / nthreads; i < n * (tid + 1) / nthreads; i++) {
+    double fx = 0, fy = 0;
+    for (int t = 0; t < nthreads; t++) {
+      fx += ps->acc[2 * (size_t)n * t + i];
+      fy += ps->acc[2 * (size_t)n * t + n + i];
+    }
+    ft->ax[i] += ft->C * fx;
+    ft->ay[i] += ft->C * fy;
+  }
+}
+
+// Accumulator buffers for nthreads threads
+void PSystem_acc(PSystem *ps, int nthreads) {
+  int size = 2 * ps->n * nthreads;
+  if (size > ps->acc_size) {
+    ps->acc_size = size;
+    ps->acc = realloc(ps->acc, sizeof(double) * size);
+  }
+}
+
+// Direct O(n^2) summation over all pairs
+void interact_direct(PSystem *ps, const double *x, const double *y,
+                     double *ax, double *ay, double C) {
+  ForceTask ft = {ps, x, y, ax, ay, C, 0, Pool_threads()};
+  PSystem_acc(ps, ft.nthreads);
+  Pool_run(direct_task, &ft, ft.nthreads);
+  Pool_run(direct_reduce, &ft, ft.nthreads);
+}
+
+//
+// Tiled direct summation
+//
+// The pair triangle is swept in TILE_I x TILE_J tiles so that both blocks
+// and their accumulators stay in cache while all their pairs are done,
+// instead of streaming every j < i again for each i. Threads split the tile
+// rows like direct_task and reduce the same way.
+//
+
+int TILE_I = 0, TILE_J = 0; // block sizes, tuned on first use
+#define TILE_REPEATS 3     // timings per block size pair, the fastest counts
+
+// Pairs i0 <= i < i1 against j0 <= j < min(j1, i)
+static inline void tile_pairs(int i0, int i1, int j0, int j1, double e2,
+                              const double *restrict x,
+                              const double *restrict y, double *restrict ax,
+                              double *restrict ay) {
+  for (int i = i0; i < i1; i++) {
+    double xi = x[i], yi = y[i], fx = 0, fy = 0;
+    int j_end = j1 < i ? j1 : i;
+    for (int j = j0; j < j_end; j++) {
+      double dx = x[j] - xi; // from i -> j
+      double dy = y[j] - yi;
+      double f = inv_r3(dx * dx + dy * dy + e2);
+      fx += dx * f;
+      fy += dy * f;
+      ax[j] -= dx * f;
+      ay[j] -= dy * f;
+    }
+    ax[i] += fx;
+    ay[i] += fy;
+  }
+}
+
+void tiled_task(void *arg, int tid, int nthreads) {
+  ForceTask *ft = arg;
+  PSystem *ps = ft->ps;
+  int n = ps->n, nb = (n + TILE_I - 1) / TILE_I;
+  double *ax = ps->acc + 2 * (size_t)n * tid, *ay = ax + n;
+  memset(ax, 0, sizeof(double) * 2 * n);
+  for (int b = direct_split(nb, tid, nthreads);
+       b < direct_split(nb, tid + 1, nthreads); b++) {
+    int i0 = b * TILE_I, i1 = i0 + TILE_I < n ? i0 + TILE_I : n;
+    for (int j0 = 0; j0 < i1 - 1; j0 += TILE_J) {
+      tile_pairs(i0, i1, j0, j0 + TILE_J, ps->E2, ft->x, ft->y, ax, ay);
+    }
+  }
+}
+
+void tiled_run(PSystem *ps, const double *x, const double *y, double *ax,
+               double *ay, double C) {
+  ForceTask ft = {ps, x, y, ax, ay, C, 0, Pool_threads()};
+  PSystem_acc(ps, ft.nthreads);
+  Pool_run(tiled_task, &ft, ft.nthreads);
+  Pool_run(direct_reduce, &ft, ft.nthreads);
+}
+
+// Time every block size pair on a cloud of 2048 bodies, after a warm-up
+// pass, and keep the fastest
+void tiled_tune() {
+  const int sizes[] = {64, 128, 256, 512, 1024};
+  int n = 2048, best_i = 256, best_j = 256;
+  PSystem *ps = calloc(1, sizeof(PSystem));
+  ps->n = n;
+  double *x = calloc(4 * n, sizeof(double));
+  double *y = x + n, *ax = y + n, *ay = ax + n;
+  for (int i = 0; i < n; i++) {
+    x[i] = cos(i * 0.37) * i / n;
+    y[i] = sin(i * 0.37) * i / n;
+  }
+  double best = INFINITY;
+  TILE_I = TILE_J = best_i;
+  tiled_run(ps, x, y, ax, ay, 1); // scratch, pool and caches
+  int nsizes = (int)(sizeof(sizes) / sizeof(sizes[0]));
+  for (int a = 0; a < nsizes; a++) {
+    for (int b = 0; b < nsizes; b++) {
+      TILE_I = sizes[a];
+      TILE_J = sizes[b];
+      double dt = INFINITY;
+      for (int r = 0; r < TILE_REPEATS; r++) {
+        double t0 = wall_time();
+        tiled_run(ps, x, y, ax, ay, 1);
+        dt = fmin(dt, wall_time() - t0);
+      }
+      if (dt < best) {
+        best = dt;
+        best_i = TILE_I;
+        best_j = TILE_J;
+      }
+    }
+  }
+  TILE_I = best_i;
+  TILE_J = best_j;
+  free(ps->acc);
+  free(ps);
+  free(x);
+}
+
+// Direct summation over cache-sized tiles
+void interact_tiled(PSystem *ps, const double *x, const double *y,
+                    double *ax, double *ay, double C) {
+  if (!TILE_I) { // on the physics thread, the first time it is selected
+    tiled_tune();
+  }
+  tiled_run(ps, x, y, ax, ay, C);
+}
+
+//
+// Vectorized direct summation
+//
+// Every body sums over all others, so each row only writes its own
+// accumulators. 1/sqrt(r^2) comes from the hardware reciprocal square root
+// refined by two Newton steps, and a compare mask drops the pairs that the
+// r3 > 1e-6 guard excludes (including i == j) instead of branching. The
+// kernels match the scalar row to SIMD_TOL relative to the largest force.
+//
+
+#define DIRECT_R2_MIN 1e-4 // r3 > 1e-6
+#define SIMD_TOL 1e-12
+
+typedef void (*DirectKernel)(int i0, int i1, int n, const double *x,
+                             const double *y, double *ax, double *ay, double C,
+                             double e2);
+
+// scalar remainder of row i from column j on
+static inline void direct_row(int i, int j, int n, const double *x,
+                              const double *y, double e2, double *ax,
+                              double *ay) {
+  for (; j < n; j++) {
+    double dx = x[j] - x[i], dy = y[j] - y[i];
+    double f = inv_r3(dx * dx + dy * dy + e2);
+    *ax += dx * f;
+    *ay += dy * f;
+  }
+}
+
+void direct_scalar(int i0, int i1, int n, const double *x, const double *y,
+                   double *ax, double *ay, double C, double e2) {
+  for (int i = i0; i < i1; i++) {
+    double fx = 0, fy = 0;
+    direct_row(i, 0, n, x, y, e2, &fx, &fy);
+    ax[i] += C * fx;
+    ay[i] += C * fy;
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) void
+direct_sse2(int i0, int i1, int n, const double *x, const double *y,
+            double *ax, double *ay, double C, double e2) {
+  const __m128d half = _mm_set1_pd(0.5), three_halves = _mm_set1_pd(1.5);
+  const __m128d r2_min = _mm_set1_pd(DIRECT_R2_MIN), e2v = _mm_set1_pd(e2);
+  for (int i = i0; i < i1; i++) {
+    __m128d xi = _mm_set1_pd(x[i]), yi = _mm_set1_pd(y[i]);
+    __m128d sx = _mm_setzero_pd(), sy = _mm_setzero_pd();
+    int j = 0;
+    for (; j + 2 <= n; j += 2) {
+      __m128d dx = _mm_sub_pd(_mm_loadu_pd(x + j), xi);
+      __m128d dy = _mm_sub_pd(_mm_loadu_pd(y + j), yi);
+      __m128d r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)),
+                              e2v);
+      __m128d r = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(r2)));
+      for (int k = 0; k < 2; k++) {
+        __m128d rr = _mm_mul_pd(_mm_mul_pd(half, r2), _mm_mul_pd(r, r));
+        r = _mm_mul_pd(r, _mm_sub_pd(three_halves, rr));
+      }
+      __m128d f = _mm_and_pd(_mm_mul_pd(r, _mm_mul_pd(r, r)),
+                             _mm_cmpgt_pd(r2, r2_min));
+      sx = _mm_add_pd(sx, _mm_mul_pd(dx, f));
+      sy = _mm_add_pd(sy, _mm_mul_pd(dy, f));
+    }
+    double tx[2], ty[2];
+    _mm_storeu_pd(tx, sx);
+    _mm_storeu_pd(ty, sy);
+    double fx = tx[0] + tx[1], fy = ty[0] + ty[1];
+    direct_row(i, j, n, x, y, e2, &fx, &fy);
+    ax[i] += C * fx;
+    ay[i] += C * fy;
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+direct_avx2(int i0, int i1, int n, const double *x, const double *y,
+            double *ax, double *ay, double C, double e2) {
+  const __m256d half = _mm256_set1_pd(0.5), three_halves = _mm256_set1_pd(1.5);
+  const __m256d r2_min = _mm256_set1_pd(DIRECT_R2_MIN);
+  const __m256d e2v = _mm256_set1_pd(e2);
+  for (int i = i0; i < i1; i++) {
+    __m256d xi = _mm256_set1_pd(x[i]), yi = _mm256_set1_pd(y[i]);
+    __m256d sx = _mm256_setzero_pd(), sy = _mm256_setzero_pd();
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), xi);
+      __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), yi);
+      __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, e2v));
+      __m256d r = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+      for (int k = 0; k < 2; k++) {
+        __m256d rr = _mm256_mul_pd(_mm256_mul_pd(half, r2), _mm256_mul_pd(r, r));
+        r = _mm256_mul_pd(r, _mm256_sub_pd(three_halves, rr));
+      }
+      __m256d f = _mm256_and_pd(_mm256_mul_pd(r, _mm256_mul_pd(r, r)),
+                                _mm256_cmp_pd(r2, r2_min, _CMP_GT_OQ));
+      sx = _mm256_fmadd_pd(dx, f, sx);
+      sy = _mm256_fmadd_pd(dy, f, sy);
+    }
+    double tx[4], ty[4];
+    _mm256_storeu_pd(tx, sx);
+    _mm256_storeu_pd(ty, sy);
+    double fx = (tx[0] + tx[1]) + (tx[2] + tx[3]);
+    double fy = (ty[0] + ty[1]) + (ty[2] + ty[3]);
+    direct_row(i, j, n, x, y, e2, &fx, &fy);
+    ax[i] += C * fx;
+    ay[i] += C * fy;
+  }
+}
+
+__attribute__((target("avx512f"))) void
+direct_avx512(int i0, int i1, int n, const double *x, const double *y,
+              double *ax, double *ay, double C, double e2) {
+  const __m512d half = _mm512_set1_pd(0.5), three_halves = _mm512_set1_pd(1.5);
+  const __m512d r2_min = _mm512_set1_pd(DIRECT_R2_MIN);
+  const __m512d e2v = _mm512_set1_pd(e2);
+  for (int i = i0; i < i1; i++) {
+    __m512d xi = _mm512_set1_pd(x[i]), yi = _mm512_set1_pd(y[i]);
+    __m512d sx = _mm512_setzero_pd(), sy = _mm512_setzero_pd();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+      __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(x + j), xi);
+      __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(y + j), yi);
+      __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, e2v));
+      __m512d r = _mm512_rsqrt14_pd(r2);
+      for (int k = 0; k < 2; k++) {
+        __m512d rr = _mm512_mul_pd(_mm512_mul_pd(half, r2), _mm512_mul_pd(r, r));
+        r = _mm512_mul_pd(r, _mm512_sub_pd(three_halves, rr));
+      }
+      __mmask8 m = _mm512_cmp_pd_mask(r2, r2_min, _CMP_GT_OQ);
+      __m512d f = _mm512_maskz_mul_pd(m, r, _mm512_mul_pd(r, r));
+      sx = _mm512_fmadd_pd(dx, f, sx);
+      sy = _mm512_fmadd_pd(dy, f, sy);
+    }
+    double fx = _mm512_reduce_add_pd(sx), fy = _mm512_reduce_add_pd(sy);
+    direct_row(i, j, n, x, y, e2, &fx, &fy);
+    ax[i] += C * fx;
+    ay[i] += C * fy;
+  }
+}
+#endif
+
+// Largest deviation of a kernel from direct_scalar on a fixed random cloud,
+// relative to the largest force
+double simd_verify(DirectKernel kernel) {
+  enum { N = 515 }; // not a multiple of the vector widths
+  static double x[N], y[N], ax0[N], ay0[N], ax1[N], ay1[N];
+  unsigned s = 12345;
+  for (int i = 0; i < N; i++) {
+    s = s * 1103515245 + 12345;
+    x[i] = (s >> 8) / (double)(1 << 24) * 4 - 2;
+    s = s * 1103515245 + 12345;
+    y[i] = (s >> 8) / (double)(1 << 24) * 4 - 2;
+  }
+  x[1] = x[0]; // a coincident pair must be masked
+  y[1] = y[0];
+  memset(ax0, 0, sizeof(ax0));
+  memset(ay0, 0, sizeof(ay0));
+  memset(ax1, 0, sizeof(ax1));
+  memset(ay1, 0, sizeof(ay1));
+  direct_scalar(0, N, N, x, y, ax0, ay0, 1, 0);
+  kernel(0, N, N, x, y, ax1, ay1, 1, 0);
+  double err = 0, norm = 0;
+  for (int i = 0; i < N; i++) {
+    err = fmax(err, hypot(ax1[i] - ax0[i], ay1[i] - ay0[i]));
+    norm = fmax(norm, hypot(ax0[i], ay0[i]));
+  }
+  return err / norm;
+}
+
+// Pick the widest kernel the CPU supports that passes simd_verify
+DirectKernel direct_kernel = NULL;
+const char *SIMD_NAME = "scalar";
+
+void simd_select() {
+  direct_kernel = direct_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  struct {
+    const char *name;
+    DirectKernel kernel;
+    int supported;
+  } kernels[] = {
+      {"avx512", direct_avx512, __builtin_cpu_supports("avx512f")},
+      {"avx2", direct_avx2,
+       __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")},
+      {"sse2", direct_sse2, __builtin_cpu_supports("sse2")},
+  };
+  for (int k = 0; k < 3; k++) {
+    if (!kernels[k].supported) {
+      continue;
+    }
+    if (simd_verify(kernels[k].kernel) < SIMD_TOL) {
+      direct_kernel = kernels[k].kernel;
+      SIMD_NAME = kernels[k].name;
+      return;
+    }
+  }
+#endif
+}
+
+void simd_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  int i0, i1;
+  while (ForceTask_rows(ft, &i0, &i1)) {
+    direct_kernel(i0, i1, ft->ps->n, ft->x, ft->y, ft->ax, ft->ay, ft->C,
+                  ft->ps->E2);
+  }
+}
+
+// Direct summation with the SIMD kernel for this CPU
+void interact_simd(PSystem *ps, const double *x, const double *y,
+                   double *ax, double *ay, double C) {
+  if (!direct_kernel) {
+    simd_select();
+  }
+  Pool_force(simd_task, ps, x, y, ax, ay, C);
+}
+
+//
+// Barnes-Hut quadtree
+//
+
+#define BH_MAX_DEPTH 32 // coincident bodies share a leaf below this depth
+
+int BHTree_node(BHTree *t, double cx, double cy, double h) {
+  if (t->n == t->cap) {
+    t->cap = t->cap ? 2 * t->cap : 64;
+    t->nodes = realloc(t->nodes, sizeof(BHNode) * t->cap);
+  }
+  BHNode *nd = &t->nodes[t->n];
+  nd->cx = cx;
+  nd->cy = cy;
+  nd->h = h;
+  nd->mx = nd->my = 0;
+  nd->count = 0;
+  nd->child = -1;
+  nd->body = -1;
+  return t->n++;
+}
+
+int BHTree_quadrant(BHNode *nd, double x, double y) {
+  return (x >= nd->cx) + 2 * (y >= nd->cy);
+}
+
+void BHTree_insert(BHTree *t, const double *x, const double *y, int b) {
+  int k = 0;
+  for (int depth = 0;; depth++) {
+    BHNode *nd = &t->nodes[k];
+    if (nd->child >= 0) {
+      k = nd->child + BHTree_quadrant(nd, x[b], y[b]);
+      continue;
+    }
+    if (nd->body < 0 || depth >= BH_MAX_DEPTH) {
+      t->next[b] = nd->body;
+      nd->body = b;
+      return;
+    }
+    // split occupied leaf and push its body one level down
+    double h = nd->h / 2, cx = nd->cx, cy = nd->cy;
+    int old = nd->body;
+    int child = BHTree_node(t, cx - h, cy - h, h);
+    BHTree_node(t, cx + h, cy - h, h);
+    BHTree_node(t, cx - h, cy + h, h);
+    BHTree_node(t, cx + h, cy + h, h);
+    nd = &t->nodes[k]; // nodes may have moved
+    nd->child = child;
+    nd->body = -1;
+    BHNode *c = &t->nodes[child + BHTree_quadrant(nd, x[old],
+                                                  y[old])];
+    c->body = old;
+    t->next[old] = -1;
+    depth--; // retry this node as an internal node
+  }
+}
+
+void BHTree_build(BHTree *t, int n, const double *x, const double *y) {
+  double x0 = x[0], x1 = x[0], y0 = y[0], y1 = y[0];
+  for (int i = 1; i < n; i++) {
+    x0 = fmin(x0, x[i]);
+    x1 = fmax(x1, x[i]);
+    y0 = fmin(y0, y[i]);
+    y1 = fmax(y1, y[i]);
+  }
+  double h = fmax(x1 - x0, y1 - y0) / 2 * 1.0001 + 1e-9;
+  t->n = 0;
+  t->next = realloc(t->next, sizeof(int) * n);
+  BHTree_node(t, (x0 + x1) / 2, (y0 + y1) / 2, h);
+  for (int i = 0; i < n; i++) {
+    BHTree_insert(t, x, y, i);
+  }
+  // children are allocated after their parents: accumulate bottom-up
+  for (int k = t->n - 1; k >= 0; k--) {
+    BHNode *nd = &t->nodes[k];
+    if (nd->child >= 0) {
+      for (int q = 0; q < 4; q++) {
+        BHNode *c = &t->nodes[nd->child + q];
+        nd->count += c->count;
+        nd->mx += c->mx * c->count;
+        nd->my += c->my * c->count;
+      }
+    } else {
+      for (int b = nd->body; b >= 0; b = t->next[b]) {
+        nd->count += 1;
+        nd->mx += x[b];
+        nd->my += y[b];
+      }
+    }
+    if (nd->count) {
+      nd->mx /= nd->count;
+      nd->my /= nd->count;
+    }
+  }
+}
+
+void bh_body(BHTree *t, const double *x, const double *y, int i, double theta,
+             double e2, double *fx, double *fy) {
+  double xi = x[i], yi = y[i];
+  int stack[4 * BH_MAX_DEPTH + 8];
+  int sp = 0;
+  stack[sp++] = 0;
+  while (sp) {
+    BHNode *nd = &t->nodes[stack[--sp]];
+    if (nd->count == 0) {
+      continue;
+    }
+    if (nd->child < 0) {
+      for (int j = nd->body; j >= 0; j = t->next[j]) {
+        if (j != i) {
+          double dx = x[j] - xi, dy = y[j] - yi;
+          double f = inv_r3(dx * dx + dy * dy + e2);
+          *fx += dx * f;
+          *fy += dy * f;
+        }
+      }
+      continue;
+    }
+    double dx = nd->mx - xi, dy = nd->my - yi;
+    double r2 = dx * dx + dy * dy;
+    int inside = fabs(xi - nd->cx) <= nd->h && fabs(yi - nd->cy) <= nd->h;
+    if (!inside && 4 * nd->h * nd->h < theta * theta * r2) {
+      double f = nd->count * inv_r3(r2 + e2);
+      *fx += dx * f;
+      *fy += dy * f;
+    } else {
+      for (int q = 0; q < 4; q++) {
+        stack[sp++] = nd->child + q;
+      }
+    }
+  }
+}
+
+void bh_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  double theta = THETA / 100.0;
+  int i0, i1;
+  while (ForceTask_rows(ft, &i0, &i1)) {
+    for (int i = i0; i < i1; i++) {
+      double fx = 0, fy = 0;
+      bh_body(&ft->ps->bh, ft->x, ft->y, i, theta, ft->ps->E2, &fx, &fy);
+      ft->ax[i] += ft->C * fx;
+      ft->ay[i] += ft->C * fy;
+    }
+  }
+}
+
+// Barnes-Hut approximation, O(n log n). A cell of width w at distance r is
+// replaced by its center of mass if w / r < THETA / 100.
+void interact_bh(PSystem *ps, const double *x, const double *y,
+                 double *ax, double *ay, double C) {
+  BHTree_build(&ps->bh, ps->n, x, y);
+  Pool_force(bh_task, ps, x, y, ax, ay, C);
+}
+
+//
+// Fast multipole method
+//
+// The interaction force C (x_j - x_i) / r^3 is the gradient of the potential
+// C / r, which is not harmonic in the plane, so complex Laurent series do not
+// apply. Instead we expand 1/r in Cartesian Taylor series: a_(i,j)(R) are the
+// derivatives d^i/dx^i d^j/dy^j (1/r) at R divided by i! j!, multipoles are
+// M_k = sum (x - c)^k, and locals L_m give phi(c + d) = sum L_m d^m.
+//
+
+#define FMM_MAX_ORDER 12
+#define FMM_MAX_LEVELS 10
+#define FMM_LEAF 16 // bodies per leaf cell we aim for
+
+#define FMM_IDX(i, j) (((i) + (j)) * ((i) + (j) + 1) / 2 + (j))
+#define FMM_TERMS(p) (((p) + 1) * ((p) + 2) / 2)
+
+double fmm_binom[2 * FMM_MAX_ORDER + 1][2 * FMM_MAX_ORDER + 1];
 
-  memset(dydt, 0, sizeof(double) * ps->n * 4);
+void fmm_init_binom() {
+  for (int n = 0; n <= 2 * FMM_MAX_ORDER; n++) {
+    fmm_binom[n][0] = 1;
+    for (int k = 1; k <= n; k++) {
+      fmm_binom[n][k] = fmm_binom[n - 1][k - 1] + (k < n ? fmm_binom[n - 1][k] : 0);
+    }
+  }
+}
+
+// Taylor coefficients of 1/r at (x, y) up to degree P, by the recurrence
+// d r^2 a_k + (2d - 1) sum x_i a_(k - e_i) + (d - 1) sum a_(k - 2 e_i) = 0
+void fmm_taylor(double x, double y, int P, double *a) {
+  double r2 = x * x + y * y;
+  a[0] = 1 / sqrt(r2);
+  for (int d = 1; d <= P; d++) {
+    for (int j = 0; j <= d; j++) {
+      int i = d - j;
+      double s = 0;
+      if (i >= 1)
+        s += (2 * d - 1) * x * a[FMM_IDX(i - 1, j)];
+      if (j >= 1)
+        s += (2 * d - 1) * y * a[FMM_IDX(i, j - 1)];
+      if (i >= 2)
+        s += (d - 1) * a[FMM_IDX(i - 2, j)];
+      if (j >= 2)
+        s += (d - 1) * a[FMM_IDX(i, j - 2)];
+      a[FMM_IDX(i, j)] = -s / (d * r2);
+    }
+  }
+}
+
+// powers x^k, y^k for k <= P
+void fmm_powers(double x, double y, int P, double *px, double *py) {
+  px[0] = py[0] = 1;
+  for (int k = 1; k <= P; k++) {
+    px[k] = px[k - 1] * x;
+    py[k] = py[k - 1] * y;
+  }
+}
+
+int fmm_cell(int level, int ix, int iy) {
+  return ((1 << (2 * level)) - 1) / 3 + (iy << level) + ix;
+}
+
+void fmm_center(FMM *f, int level, int ix, int iy, double *cx, double *cy) {
+  double cw = f->w / (1 << level);
+  *cx = f->x0 + (ix + 0.5) * cw;
+  *cy = f->y0 + (iy + 0.5) * cw;
+}
+
+// Sort bodies into the 4^L leaf cells (counting sort). Returns the mean
+// occupancy of the leaf a body sits in.
+double FMM_bucket(FMM *f, int n, const double *x, const double *y, int L) {
+  int side = 1 << L, nleaf = side * side;
+  double cw = f->w / side;
+  f->start = realloc(f->start, sizeof(int) * (nleaf + 1));
+  memset(f->start, 0, sizeof(int) * (nleaf + 1));
+  for (int i = 0; i < n; i++) {
+    int ix = (int)((x[i] - f->x0) / cw);
+    int iy = (int)((y[i] - f->y0) / cw);
+    ix = ix < 0 ? 0 : ix >= side ? side - 1 : ix;
+    iy = iy < 0 ? 0 : iy >= side ? side - 1 : iy;
+    f->leaf[i] = iy * side + ix;
+    f->start[f->leaf[i] + 1]++;
+  }
+  double occupancy = 0;
+  for (int c = 0; c < nleaf; c++) {
+    occupancy += (double)f->start[c + 1] * f->start[c + 1];
+    f->start[c + 1] += f->start[c];
+  }
+  for (int i = 0; i < n; i++) {
+    f->perm[f->start[f->leaf[i]]++] = i;
+  }
+  for (int c = nleaf; c > 0; c--) {
+    f->start[c] = f->start[c - 1];
+  }
+  f->start[0] = 0;
+  return occupancy / n;
+}
+
+// Pick the leaf level for the current distribution and size the expansions
+void FMM_prepare(FMM *f, int n, const double *x, const double *y) {
+  double x0 = x[0], x1 = x[0], y0 = y[0], y1 = y[0];
+  for (int i = 1; i < n; i++) {
+    x0 = fmin(x0, x[i]);
+    x1 = fmax(x1, x[i]);
+    y0 = fmin(y0, y[i]);
+    y1 = fmax(y1, y[i]);
+  }
+  f->w = fmax(x1 - x0, y1 - y0) * 1.0001 + 1e-9;
+  f->x0 = (x0 + x1 - f->w) / 2;
+  f->y0 = (y0 + y1 - f->w) / 2;
+  f->leaf = realloc(f->leaf, sizeof(int) * n);
+  f->perm = realloc(f->perm, sizeof(int) * n);
+  if (fmm_binom[0][0] == 0) {
+    fmm_init_binom();
+  }
+
+  // refine until the leaves are populated about FMM_LEAF deep
+  int L = 2;
+  while (FMM_bucket(f, n, x, y, L) > 2 * FMM_LEAF && L < FMM_MAX_LEVELS &&
+         (1 << (2 * L)) < n) {
+    L++;
+  }
+  int p = FMM_ORDER < 1 ? 1 : FMM_ORDER > FMM_MAX_ORDER ? FMM_MAX_ORDER
+                                                          : FMM_ORDER;
+  if (L != f->levels || p != f->order) {
+    f->levels = L;
+    f->order = p;
+    f->nterms = FMM_TERMS(p);
+    f->ncells = ((1 << (2 * (L + 1))) - 1) / 3;
+    f->M = realloc(f->M, sizeof(double) * f->ncells * f->nterms);
+    f->L = realloc(f->L, sizeof(double) * f->ncells * f->nterms);
+    f->K = realloc(f->K, sizeof(double) * 49 * f->nterms * f->nterms);
+  }
+}
+
+void FMM_upward(FMM *f, const double *x, const double *y) {
+  int L = f->levels, p = f->order, nt = f->nterms, side = 1 << L;
+  double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+  memset(f->M, 0, sizeof(double) * f->ncells * nt);
+
+  // P2M
+  for (int iy = 0; iy < side; iy++) {
+    for (int ix = 0; ix < side; ix++) {
+      double cx, cy, *M = f->M + fmm_cell(L, ix, iy) * nt;
+      fmm_center(f, L, ix, iy, &cx, &cy);
+      int c = iy * side + ix;
+      for (int s = f->start[c]; s < f->start[c + 1]; s++) {
+        int b = f->perm[s];
+        fmm_powers(x[b] - cx, y[b] - cy, p, px, py);
+        for (int d = 0; d <= p; d++) {
+          for (int j = 0; j <= d; j++) {
+            M[FMM_IDX(d - j, j)] += px[d - j] * py[j];
+          }
+        }
+      }
+    }
+  }
+
+  // M2M: M'_k = sum_(m <= k) binom(k, m) M_m e^(k - m), e = child - parent
+  for (int l = L; l > 2; l--) {
+    double e = f->w / (1 << (l + 1)); // child center offset
+    for (int iy = 0; iy < (1 << l); iy++) {
+      for (int ix = 0; ix < (1 << l); ix++) {
+        const double *M = f->M + fmm_cell(l, ix, iy) * nt;
+        double *P = f->M + fmm_cell(l - 1, ix >> 1, iy >> 1) * nt;
+        fmm_powers(ix & 1 ? e : -e, iy & 1 ? e : -e, p, px, py);
+        for (int kx = 0; kx <= p; kx++) {
+          for (int ky = 0; kx + ky <= p; ky++) {
+            double s = 0;
+            for (int mx = 0; mx <= kx; mx++) {
+              for (int my = 0; my <= ky; my++) {
+                s += fmm_binom[kx][mx] * fmm_binom[ky][my] *
+                     M[FMM_IDX(mx, my)] * px[kx - mx] * py[ky - my];
+              }
+            }
+            P[FMM_IDX(kx, ky)] += s;
+          }
+        }
+      }
+    }
+  }
+}
+
+void FMM_downward(FMM *f) {
+  int L = f->levels, p = f->order, nt = f->nterms;
+  double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+  double a[FMM_TERMS(2 * FMM_MAX_ORDER)];
+  memset(f->L, 0, sizeof(double) * f->ncells * nt);
+
+  for (int l = 2; l <= L; l++) {
+    int side = 1 << l;
+    double cw = f->w / side;
+    // M2L: L_m += sum_k (-1)^|k| binom(k + m, k) a_(k + m)(c_B - c_A) M_k,
+    // one nt x nt matrix per cell offset of the 7x7 interaction stencil
+    for (int o = 0; o < 49; o++) {
+      int ox = o % 7 - 3, oy = o / 7 - 3;
+      if (abs(ox) <= 1 && abs(oy) <= 1) {
+        continue;
+      }
+      fmm_taylor(ox * cw, oy * cw, 2 * p, a);
+      double *K = f->K + o * nt * nt;
+      for (int mx = 0; mx <= p; mx++) {
+        for (int my = 0; mx + my <= p; my++) {
+          for (int kx = 0; kx <= p; kx++) {
+            for (int ky = 0; kx + ky <= p; ky++) {
+              K[FMM_IDX(mx, my) * nt + FMM_IDX(kx, ky)] =
+                  ((kx + ky) & 1 ? -1 : 1) * fmm_binom[kx + mx][kx] *
+                  fmm_binom[ky + my][ky] * a[FMM_IDX(kx + mx, ky + my)];
+            }
+          }
+        }
+      }
+    }
+
+    for (int iy = 0; iy < side; iy++) {
+      for (int ix = 0; ix < side; ix++) {
+        int b = fmm_cell(l, ix, iy);
+        if (f->M[b * nt] == 0) {
+          continue; // no bodies below this cell
+        }
+        double *Lb = f->L + b * nt;
+        for (int jy = ((iy >> 1) - 1) * 2; jy < ((iy >> 1) + 2) * 2; jy++) {
+          for (int jx = ((ix >> 1) - 1) * 2; jx < ((ix >> 1) + 2) * 2; jx++) {
+            if (jx < 0 || jy < 0 || jx >= side || jy >= side ||
+                (abs(jx - ix) <= 1 && abs(jy - iy) <= 1)) {
+              continue;
+            }
+            const double *Ma = f->M + fmm_cell(l, jx, jy) * nt;
+            if (Ma[0] == 0) {
+              continue;
+            }
+            const double *K = f->K + ((iy - jy + 3) * 7 + (ix - jx + 3)) * nt * nt;
+            for (int m = 0; m < nt; m++) {
+              double s = 0;
+              for (int k = 0; k < nt; k++) {
+                s += K[m * nt + k] * Ma[k];
+              }
+              Lb[m] += s;
+            }
+          }
+        }
+      }
+    }
+
+    // L2L: L'_n = sum_(m >= n) binom(m, n) L_m e^(m - n), e = child - parent
+    if (l == L) {
+      break;
+    }
+    double e = cw / 4;
+    for (int iy = 0; iy < 2 * side; iy++) {
+      for (int ix = 0; ix < 2 * side; ix++) {
+        const double *P = f->L + fmm_cell(l, ix >> 1, iy >> 1) * nt;
+        double *Lc = f->L + fmm_cell(l + 1, ix, iy) * nt;
+        fmm_powers(ix & 1 ? e : -e, iy & 1 ? e : -e, p, px, py);
+        for (int nx = 0; nx <= p; nx++) {
+          for (int ny = 0; nx + ny <= p; ny++) {
+            double s = 0;
+            for (int mx = nx; mx <= p; mx++) {
+              for (int my = ny; mx + my <= p; my++) {
+                s += fmm_binom[mx][nx] * fmm_binom[my][ny] *
+                     P[FMM_IDX(mx, my)] * px[mx - nx] * py[my - ny];
+              }
+            }
+            Lc[FMM_IDX(nx, ny)] += s;
+          }
+        }
+      }
+    }
+  }
+}
+
+// L2P and P2P for body i
+void fmm_body(FMM *f, const double *x, const double *y, int i, double e2,
+              double *fx, double *fy) {
+  int L = f->levels, p = f->order, nt = f->nterms, side = 1 << L;
+  int ix = f->leaf[i] % side, iy = f->leaf[i] / side;
+  double xi = x[i], yi = y[i];
+  double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+
+  // L2P: a = grad phi
+  double cx, cy;
+  const double *Lc = f->L + fmm_cell(L, ix, iy) * nt;
+  fmm_center(f, L, ix, iy, &cx, &cy);
+  fmm_powers(xi - cx, yi - cy, p, px, py);
+  for (int mx = 0; mx <= p; mx++) {
+    for (int my = 0; mx + my <= p; my++) {
+      double l = Lc[FMM_IDX(mx, my)];
+      if (mx)
+        *fx += l * mx * px[mx - 1] * py[my];
+      if (my)
+        *fy += l * my * px[mx] * py[my - 1];
+    }
+  }
+
+  // P2P with the neighbor leaves
+  for (int jy = iy - 1; jy <= iy + 1; jy++) {
+    for (int jx = ix - 1; jx <= ix + 1; jx++) {
+      if (jx < 0 || jy < 0 || jx >= side || jy >= side) {
+        continue;
+      }
+      int c = jy * side + jx;
+      for (int s = f->start[c]; s < f->start[c + 1]; s++) {
+        int j = f->perm[s];
+        if (j != i) {
+          double dx = x[j] - xi, dy = y[j] - yi;
+          double r = inv_r3(dx * dx + dy * dy + e2);
+          *fx += dx * r;
+          *fy += dy * r;
+        }
+      }
+    }
+  }
+}
+
+void fmm_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  int i0, i1;
+  while (ForceTask_rows(ft, &i0, &i1)) {
+    for (int i = i0; i < i1; i++) {
+      double fx = 0, fy = 0;
+      fmm_body(&ft->ps->fmm, ft->x, ft->y, i, ft->ps->E2, &fx, &fy);
+      ft->ax[i] += ft->C * fx;
+      ft->ay[i] += ft->C * fy;
+    }
+  }
+}
+
+// Fast multipole method, O(n) for bounded leaf occupancy. The far field
+// comes from order FMM_ORDER expansions, neighbor leaves are summed directly.
+void interact_fmm(PSystem *ps, const double *x, const double *y,
+                  double *ax, double *ay, double C) {
+  FMM *f = &ps->fmm;
+  FMM_prepare(f, ps->n, x, y);
+  FMM_upward(f, x, y);
+  FMM_downward(f);
+  Pool_force(fmm_task, ps, x, y, ax, ay, C);
+}
+
+//
+// Cell list
+//
+// Interactions cut off at CUTOFF: bodies are counting-sorted into a uniform
+// grid of cells at least that wide, so all partners of a body lie in the 3x3
+// cells around it. On the torus the grid covers one period and wraps, and
+// pairs are taken at their nearest image.
+//
+
+#define CELL_MAX_RATIO 4 // cells per body at most, coarser grids above
+
+// Cell of coordinate u on a row of n cells of width w starting at u0
+int cell_index(double u, double u0, double w, int n, int torus) {
+  double c = (u - u0) / w;
+  if (torus) {
+    c -= n * floor(c / n);
+  }
+  return c < 0 ? 0 : c >= n ? n - 1 : (int)c;
+}
+
+// Distinct cells next to cell i of a row of n, at most 3
+int cell_row(int i, int n, int torus, int *cols) {
+  int k = 0;
+  if (torus && n < 3) {
+    for (int c = 0; c < n; c++) {
+      cols[k++] = c;
+    }
+    return k;
+  }
+  for (int c = i - 1; c <= i + 1; c++) {
+    if (torus) {
+      cols[k++] = (c + n) % n;
+    } else if (c >= 0 && c < n) {
+      cols[k++] = c;
+    }
+  }
+  return k;
+}
+
+// Wrap around the screen for the torus, whose period is the screen in
+// simulation units as in PSystem_bound
+void CellList_topology(CellList *cl) {
+  float s = (float)SCALE * 20.f + 200;
+  cl->torus = TOPOLOGY == 1;
+  cl->lx = screenWidth / s;
+  cl->ly = screenHeight / s;
+}
+
+void CellList_build(CellList *cl, int n, const double *x, const double *y,
+                    double rc) {
+  double x0, x1, y0, y1;
+  if (cl->torus) {
+    x0 = -cl->lx / 2, x1 = cl->lx / 2;
+    y0 = -cl->ly / 2, y1 = cl->ly / 2;
+  } else {
+    x0 = x1 = x[0];
+    y0 = y1 = y[0];
+    for (int i = 1; i < n; i++) {
+      x0 = fmin(x0, x[i]);
+      x1 = fmax(x1, x[i]);
+      y0 = fmin(y0, y[i]);
+      y1 = fmax(y1, y[i]);
+    }
+    x1 += 1e-9;
+    y1 += 1e-9;
+  }
+  // cells no smaller than rc, and scaled up if they would outnumber the
+  // bodies by more than CELL_MAX_RATIO
+  double w = x1 - x0, h = y1 - y0;
+  double s = fmax(1, sqrt(w / rc * h / rc / (CELL_MAX_RATIO * (double)n + 16)));
+  cl->nx = (int)fmax(1, floor(w / (rc * s)));
+  cl->ny = (int)fmax(1, floor(h / (rc * s)));
+  cl->x0 = x0;
+  cl->y0 = y0;
+  cl->cw = w / cl->nx;
+  cl->ch = h / cl->ny;
+  cl->rc2 = rc * rc;
+
+  int nc = cl->nx * cl->ny;
+  if (n > cl->cap) {
+    cl->cap = n;
+    cl->cell = realloc(cl->cell, sizeof(int) * n);
+    cl->perm = realloc(cl->perm, sizeof(int) * n);
+    cl->sx = realloc(cl->sx, sizeof(double) * n);
+    cl->sy = realloc(cl->sy, sizeof(double) * n);
+  }
+  if (nc + 1 > cl->ncap) {
+    cl->ncap = nc + 1;
+    cl->start = realloc(cl->start, sizeof(int) * cl->ncap);
+  }
+
+  // counting sort by cell
+  memset(cl->start, 0, sizeof(int) * (nc + 1));
+  for (int i = 0; i < n; i++) {
+    int ix = cell_index(x[i], x0, cl->cw, cl->nx, cl->torus);
+    int iy = cell_index(y[i], y0, cl->ch, cl->ny, cl->torus);
+    cl->cell[i] = iy * cl->nx + ix;
+    cl->start[cl->cell[i] + 1]++;
+  }
+  for (int c = 0; c < nc; c++) {
+    cl->start[c + 1] += cl->start[c];
+  }
+  for (int i = 0; i < n; i++) {
+    int k = cl->start[cl->cell[i]]++;
+    cl->perm[k] = i;
+    cl->sx[k] = x[i];
+    cl->sy[k] = y[i];
+  }
+  for (int c = nc; c > 0; c--) {
+    cl->start[c] = cl->start[c - 1];
+  }
+  cl->start[0] = 0;
+}
+
+// Short-range force of erfc(a r) / r relative to 1/r^2
+static inline double p3m_short(double u) {
+  return erfc(u) + M_2_SQRTPI * u * exp(-u * u);
+}
+
+// Short-range pair factor: inv_r3(r2 + e2) less the smooth erf(a r) / r part
+// that the mesh or the reciprocal sum applies. Softened pairs and pairs
+// that inv_r3 excludes take the smooth part off explicitly, it is
+// 4 a^3 / 3 sqrt(pi) (1 - 3 u^2 / 5) for small u.
+static inline double p3m_pair(double a, double r2, double e2) {
+  double r = sqrt(r2), u = a * r;
+  if (e2 == 0 && r2 * r > 1e-6) {
+    return p3m_short(u) / (r2 * r);
+  }
+  if (u < 1e-2) {
+    double smooth = a * a * a * M_2_SQRTPI * 2 / 3 * (1 - 0.6 * u * u);
+    return inv_r3(r2 + e2) - smooth;
+  }
+  return inv_r3(r2 + e2) - (1 - p3m_short(u)) / (r2 * r);
+}
+
+// Forces on the body at sorted position k from its neighbor cells
+void cell_body(CellList *cl, int k, double e2, double *fx, double *fy) {
+  int c = cl->cell[cl->perm[k]];
+  int cols[3], rows[3];
+  int ncols = cell_row(c % cl->nx, cl->nx, cl->torus, cols);
+  int nrows = cell_row(c / cl->nx, cl->ny, cl->torus, rows);
+  double xi = cl->sx[k], yi = cl->sy[k];
+  for (int r = 0; r < nrows; r++) {
+    for (int q = 0; q < ncols; q++) {
+      int d = rows[r] * cl->nx + cols[q];
+      for (int m = cl->start[d]; m < cl->start[d + 1]; m++) {
+        double dx = cl->sx[m] - xi, dy = cl->sy[m] - yi;
+        if (cl->torus) { // nearest image
+          dx -= cl->lx * nearbyint(dx / cl->lx);
+          dy -= cl->ly * nearbyint(dy / cl->ly);
+        }
+        double r2 = dx * dx + dy * dy;
+        if (m != k && r2 < cl->rc2) {
+          double f = cl->alpha > 0 ? p3m_pair(cl->alpha, r2, e2)
+                                   : inv_r3(r2 + e2);
+          *fx += dx * f;
+          *fy += dy * f;
+        }
+      }
+    }
+  }
+}
+
+// Rows are positions in the sorted order, so neighboring rows share cells
+void cell_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  CellList *cl = &ft->ps->cells;
+  int k0, k1;
+  while (ForceTask_rows(ft, &k0, &k1)) {
+    for (int k = k0; k < k1; k++) {
+      double fx = 0, fy = 0;
+      cell_body(cl, k, ft->ps->E2, &fx, &fy);
+      int i = cl->perm[k];
+      ft->ax[i] += ft->C * fx;
+      ft->ay[i] += ft->C * fy;
+    }
+  }
+}
+
+// Interactions within CUTOFF / 100 only, O(n) for bounded density
+void interact_cells(PSystem *ps, const double *x, const double *y,
+                    double *ax, double *ay, double C) {
+  double rc = CUTOFF / 100.0;
+  if (rc <= 0) {
+    return;
+  }
+  CellList *cl = &ps->cells;
+  CellList_topology(cl);
+  CellList_build(cl, ps->n, x, y, rc);
+  cl->alpha = 0;
+  Pool_force(cell_task, ps, x, y, ax, ay, C);
+}
+
+//
+// Verlet lists
+//
+// Every body keeps the list of bodies within CUTOFF + SKIN, found through a
+// cell list at that radius. While no body has moved more than SKIN / 2 since
+// the lists were built, no pair can have come closer than CUTOFF from
+// outside the lists, so the RK stages and the following steps reuse them.
+//
+
+// Neighbors of sorted body k within cutoff + skin; stored from out[0] on
+// unless out is NULL
+int verlet_scan(CellList *cl, int k, int *out) {
+  int c = cl->cell[cl->perm[k]];
+  int cols[3], rows[3];
+  int ncols = cell_row(c % cl->nx, cl->nx, cl->torus, cols);
+  int nrows = cell_row(c / cl->nx, cl->ny, cl->torus, rows);
+  double xi = cl->sx[k], yi = cl->sy[k];
+  int count = 0;
+  for (int r = 0; r < nrows; r++) {
+    for (int q = 0; q < ncols; q++) {
+      int d = rows[r] * cl->nx + cols[q];
+      for (int m = cl->start[d]; m < cl->start[d + 1]; m++) {
+        double dx = cl->sx[m] - xi, dy = cl->sy[m] - yi;
+        if (cl->torus) {
+          dx -= cl->lx * nearbyint(dx / cl->lx);
+          dy -= cl->ly * nearbyint(dy / cl->ly);
+        }
+        if (m != k && dx * dx + dy * dy < cl->rc2) {
+          if (out) {
+            out[count] = cl->perm[m];
+          }
+          count++;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+void verlet_count(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  VerletList *vl = &ft->ps->verlet;
+  int k0, k1;
+  while (ForceTask_rows(ft, &k0, &k1)) {
+    for (int k = k0; k < k1; k++) {
+      vl->start[k + 1] = verlet_scan(&vl->cells, k, NULL);
+    }
+  }
+}
+
+void verlet_fill(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  VerletList *vl = &ft->ps->verlet;
+  int k0, k1;
+  while (ForceTask_rows(ft, &k0, &k1)) {
+    for (int k = k0; k < k1; k++) {
+      verlet_scan(&vl->cells, k, vl->nbr + vl->start[k]);
+    }
+  }
+}
+
+// Whether the lists miss pairs at these positions: new bodies, changed
+// radii or topology, or a body that moved more than half the skin
+int VerletList_stale(VerletList *vl, int n, const double *x, const double *y,
+                     double rc, double skin) {
+  CellList *cl = &vl->cells;
+  if (vl->n != n || vl->rc != rc || vl->skin != skin ||
+      cl->torus != (TOPOLOGY == 1)) {
+    return 1;
+  }
+  float s = (float)SCALE * 20.f + 200;
+  if (cl->torus && (cl->lx != screenWidth / s || cl->ly != screenHeight / s)) {
+    return 1;
+  }
+  double lim = skin * skin / 4;
+  for (int i = 0; i < n; i++) {
+    double dx = x[i] - vl->x0[i], dy = y[i] - vl->y0[i];
+    if (cl->torus) { // wrapped bodies have not moved
+      dx -= cl->lx * nearbyint(dx / cl->lx);
+      dy -= cl->ly * nearbyint(dy / cl->ly);
+    }
+    if (dx * dx + dy * dy > lim) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void VerletList_build(PSystem *ps, const double *x, const double *y, double rc,
+                      double skin) {
+  VerletList *vl = &ps->verlet;
+  int n = ps->n;
+  CellList_topology(&vl->cells);
+  CellList_build(&vl->cells, n, x, y, rc + skin);
+  if (n > vl->n) {
+    vl->x0 = realloc(vl->x0, sizeof(double) * n);
+    vl->y0 = realloc(vl->y0, sizeof(double) * n);
+    vl->start = realloc(vl->start, sizeof(int) * (n + 1));
+  }
+  memcpy(vl->x0, x, sizeof(double) * n);
+  memcpy(vl->y0, y, sizeof(double) * n);
+  vl->n = n;
+  vl->rc = rc;
+  vl->skin = skin;
+
+  // count, then fill the lists in sorted order
+  vl->start[0] = 0;
+  Pool_force(verlet_count, ps, x, y, NULL, NULL, 0);
+  for (int k = 0; k < n; k++) {
+    vl->start[k + 1] += vl->start[k];
+  }
+  if (vl->start[n] > vl->nbr_cap) {
+    vl->nbr_cap = 2 * vl->start[n];
+    vl->nbr = realloc(vl->nbr, sizeof(int) * vl->nbr_cap);
+  }
+  Pool_force(verlet_fill, ps, x, y, NULL, NULL, 0);
+  vl->rebuilds++;
+}
+
+void verlet_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  VerletList *vl = &ft->ps->verlet;
+  CellList *cl = &vl->cells;
+  const double *x = ft->x, *y = ft->y;
+  double rc2 = vl->rc * vl->rc, e2 = ft->ps->E2;
+  int k0, k1;
+  while (ForceTask_rows(ft, &k0, &k1)) {
+    for (int k = k0; k < k1; k++) {
+      int i = cl->perm[k];
+      double fx = 0, fy = 0;
+      for (int s = vl->start[k]; s < vl->start[k + 1]; s++) {
+        int j = vl->nbr[s];
+        double dx = x[j] - x[i], dy = y[j] - y[i];
+        if (cl->torus) {
+          dx -= cl->lx * nearbyint(dx / cl->lx);
+          dy -= cl->ly * nearbyint(dy / cl->ly);
+        }
+        double r2 = dx * dx + dy * dy;
+        if (r2 < rc2) {
+          double f = inv_r3(r2 + e2);
+          fx += dx * f;
+          fy += dy * f;
+        }
+      }
+      ft->ax[i] += ft->C * fx;
+      ft->ay[i] += ft->C * fy;
+    }
+  }
+}
+
+// Same forces as interact_cells, with the neighbor search redone only when
+// VerletList_stale says so; see VerletList.rebuilds
+void interact_verlet(PSystem *ps, const double *x, const double *y,
+                     double *ax, double *ay, double C) {
+  double rc = CUTOFF / 100.0, skin = fmax(SKIN, 0) / 100.0;
+  if (rc <= 0) {
+    return;
+  }
+  VerletList *vl = &ps->verlet;
+  if (VerletList_stale(vl, ps->n, x, y, rc, skin)) {
+    VerletList_build(ps, x, y, rc, skin);
+  }
+  vl->evals++;
+  Pool_force(verlet_task, ps, x, y, ax, ay, C);
+}
+
+//
+// Particle mesh
+//
+// Periodic forces for the torus. The acceleration C sum (x_j - x) / r^3 is
+// C grad psi with psi = sum 1 / |x - x_j|, and 1/r transforms to 2 pi / |k|
+// in the plane. Bodies are deposited on the mesh with cloud-in-cell
+// weights, psi is solved by FFT with the mean (k = 0) removed, grad psi
+// comes from multiplying by i k, and is interpolated back with the same
+// weights. Structure below the mesh spacing is smoothed out.
+//
+
+#define PM_MAX_GRID 10
+
+// Cloud-in-cell: lower node i along a periodic row of n and the weight f of
+// node i + 1
+static inline void pm_cic(double u, double h, int n, int *i, double *f) {
+  u /= h;
+  double c = floor(u);
+  *f = u - c;
+  c -= n * floor(c / n);
+  *i = (int)c % n;
+}
+
+void PM_prepare(PM *pm) {
+  int g = PM_GRID < 1 ? 1 : PM_GRID > PM_MAX_GRID ? PM_MAX_GRID : PM_GRID;
+  float s = (float)SCALE * 20.f + 200;
+  pm->lx = screenWidth / s;
+  pm->ly = screenHeight / s;
+  pm->gx = 1 << g;
+  // about square cells
+  int gy = (int)round(log2(pm->gx * pm->ly / pm->lx));
+  pm->gy = 1 << (gy < 1 ? 1 : gy > PM_MAX_GRID ? PM_MAX_GRID : gy);
+  pm->hx = pm->lx / pm->gx;
+  pm->hy = pm->ly / pm->gy;
+  if (pm->gx * pm->gy > pm->size) {
+    pm->size = pm->gx * pm->gy;
+    pm->mesh = realloc(pm->mesh, sizeof(double) * 2 * pm->size);
+  }
+}
+
+// Arguments of a parallel FFT pass over the mesh
+typedef struct {
+  PSystem *ps;
+  int sign; // forward if > 0
+  int dir;  // rows (0) or columns (1)
+} FFTTask;
+
+// Mesh rows or columns split between threads
+void pm_fft_task(void *arg, int tid, int nthreads) {
+  FFTTask *ft = arg;
+  PM *pm = &ft->ps->pm;
+  int dir = ft->dir, lines = dir ? pm->gx : pm->gy;
+  for (int l = lines * tid / nthreads; l < lines * (tid + 1) / nthreads; l++) {
+    double *d = pm->mesh + 2 * (dir ? l : l * pm->gx);
+    size_t stride = dir ? pm->gx : 1, len = dir ? pm->gy : pm->gx;
+    if (ft->sign > 0) {
+      gsl_fft_complex_radix2_forward(d, stride, len);
+    } else {
+      gsl_fft_complex_radix2_inverse(d, stride, len);
+    }
+  }
+}
+
+void PM_fft(PSystem *ps, int sign) {
+  for (int dir = 0; dir < 2; dir++) {
+    FFTTask ft = {ps, sign, dir};
+    Pool_run(pm_fft_task, &ft, Pool_threads());
+  }
+}
+
+// sin(u) / u
+static inline double sinc(double u) { return u == 0 ? 1 : sin(u) / u; }
+
+// Replace the mesh of body counts by grad psi, d/dx in the real and d/dy in
+// the imaginary part: both fields are real, so one inverse transform of
+// i kx psi + i (i ky psi) gives them together. For alpha > 0 psi is the
+// erf(alpha r) / r part of P3M, with the cloud-in-cell smoothing of
+// deposition and interpolation divided out.
+void PM_solve(PSystem *ps, double alpha) {
+  PM *pm = &ps->pm;
+  PM_fft(ps, +1);
+  double norm = 2 * M_PI / (pm->hx * pm->hy);
+  for (int iy = 0; iy < pm->gy; iy++) {
+    int my = iy < pm->gy / 2 ? iy : iy - pm->gy;
+    double ky = 2 * M_PI * my / pm->ly;
+    for (int ix = 0; ix < pm->gx; ix++) {
+      int mx = ix < pm->gx / 2 ? ix : ix - pm->gx;
+      double kx = 2 * M_PI * mx / pm->lx;
+      double *d = pm->mesh + 2 * (iy * pm->gx + ix);
+      double k = sqrt(kx * kx + ky * ky);
+      double g = k > 0 ? norm / k : 0;
+      if (alpha > 0) {
+        double w = sinc(kx * pm->hx / 2) * sinc(ky * pm->hy / 2);
+        g *= erfc(k / (2 * alpha)) / (w * w * w * w);
+      }
+      double re = d[0] * g, im = d[1] * g;
+      // no derivative at the Nyquist frequency
+      double dx = 2 * mx == -pm->gx ? 0 : kx, dy = 2 * my == -pm->gy ? 0 : ky;
+      // i kx psi - ky psi
+      d[0] = -dx * im - dy * re;
+      d[1] = dx * re - dy * im;
+    }
+  }
+  PM_fft(ps, -1);
+}
+
+void pm_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  PM *pm = &ft->ps->pm;
+  int i0, i1;
+  while (ForceTask_rows(ft, &i0, &i1)) {
+    for (int i = i0; i < i1; i++) {
+      int ix, iy;
+      double fx, fy;
+      pm_cic(ft->x[i] + pm->lx / 2, pm->hx, pm->gx, &ix, &fx);
+      pm_cic(ft->y[i] + pm->ly / 2, pm->hy, pm->gy, &iy, &fy);
+      int jx = (ix + 1) % pm->gx, jy = (iy + 1) % pm->gy;
+      double *r0 = pm->mesh + 2 * iy * pm->gx, *r1 = pm->mesh + 2 * jy * pm->gx;
+      double w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy);
+      double w01 = (1 - fx) * fy, w11 = fx * fy;
+      for (int c = 0; c < 2; c++) {
+        double a = w00 * r0[2 * ix + c] + w10 * r0[2 * jx + c] +
+                   w01 * r1[2 * ix + c] + w11 * r1[2 * jx + c];
+        (c ? ft->ay : ft->ax)[i] += ft->C * a;
+      }
+    }
+  }
+}
+
+void PM_forces(PSystem *ps, const double *x, const double *y, double *ax,
+               double *ay, double C, double alpha) {
+  PM *pm = &ps->pm;
+  PM_prepare(pm);
+  memset(pm->mesh, 0, sizeof(double) * 2 * pm->gx * pm->gy);
+  for (int i = 0; i < ps->n; i++) {
+    int ix, iy;
+    double fx, fy;
+    pm_cic(x[i] + pm->lx / 2, pm->hx, pm->gx, &ix, &fx);
+    pm_cic(y[i] + pm->ly / 2, pm->hy, pm->gy, &iy, &fy);
+    int jx = (ix + 1) % pm->gx, jy = (iy + 1) % pm->gy;
+    pm->mesh[2 * (iy * pm->gx + ix)] += (1 - fx) * (1 - fy);
+    pm->mesh[2 * (iy * pm->gx + jx)] += fx * (1 - fy);
+    pm->mesh[2 * (jy * pm->gx + ix)] += (1 - fx) * fy;
+    pm->mesh[2 * (jy * pm->gx + jx)] += fx * fy;
+  }
+  PM_solve(ps, alpha);
+  Pool_force(pm_task, ps, x, y, ax, ay, C);
+}
+
+// Particle mesh on a 2^PM_GRID wide periodic mesh, O(n + G log G) for G
+// mesh nodes
+void interact_pm(PSystem *ps, const double *x, const double *y,
+                 double *ax, double *ay, double C) {
+  PM_forces(ps, x, y, ax, ay, C, 0);
+}
+
+//
+// P3M
+//
+// 1/r = erf(alpha r) / r + erfc(alpha r) / r. The smooth first part goes
+// through the mesh with Green function 2 pi erfc(k / 2 alpha) / |k|, the
+// second decays within the split radius rs = P3M_SPLIT / 100 for
+// alpha = P3M_ALPHA_RS / rs and is summed over a cell list at rs.
+//
+
+#define P3M_ALPHA_RS 3.0 // a pair keeps p3m_short(3) = 4e-4 at rs
+
+void interact_p3m(PSystem *ps, const double *x, const double *y,
+                  double *ax, double *ay, double C) {
+  double rs = fmax(P3M_SPLIT, 1) / 100.0, alpha = P3M_ALPHA_RS / rs;
+  PM_forces(ps, x, y, ax, ay, C, alpha);
+  CellList *cl = &ps->cells;
+  CellList_topology(cl);
+  CellList_build(cl, ps->n, x, y, rs);
+  cl->alpha = alpha;
+  Pool_force(cell_task, ps, x, y, ax, ay, C);
+}
+
+//
+// Ewald summation
+//
+// The same split as P3M, with the smooth part summed exactly over the
+// reciprocal lattice instead of a mesh:
+//   a_i = C / A sum_k 2 pi erfc(k / 2 alpha) / k  k sum_j sin(k (x_j - x_i))
+// Pairs beyond the real-space cutoff rc drop p3m_short(alpha rc), and k
+// vectors beyond kc = 2 alpha^2 rc drop less than that; rc is set so that
+// this equals the tolerance. alpha balances the n^2 rc^2 real-space pairs
+// against the n kc^2 reciprocal terms. The k vectors and weights are
+// tabulated when the period or alpha change, the phases e^(i k x) per
+// evaluation from powers of e^(i 2 pi x / l).
+//
+
+// u with p3m_short(u) = tol, by Newton steps on its log
+double ewald_cutoff(double tol) {
+  double u = sqrt(-log(tol));
+  for (int it = 0; it < 20; it++) {
+    double f = log(p3m_short(u)) - log(tol);
+    double df = -M_2_SQRTPI * 2 * u * u * exp(-u * u) / p3m_short(u);
+    u -= f / df;
+  }
+  return u;
+}
+
+void Ewald_prepare(Ewald *ew, int n, double tol) {
+  float s = (float)SCALE * 20.f + 200;
+  double lx = screenWidth / s, ly = screenHeight / s;
+  double area = lx * ly, u = ewald_cutoff(tol);
+  double alpha = pow(2 * M_PI * M_PI * n, 0.25) / sqrt(area);
+  // only the nearest image of a pair is inside rc
+  alpha = fmax(alpha, u / (0.5 * fmin(lx, ly)));
+  if (ew->lx == lx && ew->ly == ly && ew->tol == tol && ew->alpha == alpha) {
+    return;
+  }
+  ew->tol = tol;
+  ew->lx = lx;
+  ew->ly = ly;
+  ew->alpha = alpha;
+  ew->rc = u / alpha;
+  double kc = 2 * alpha * u;
+  ew->mx = (int)(kc * lx / (2 * M_PI));
+  ew->my = (int)(kc * ly / (2 * M_PI));
+  int size = (ew->mx + 1) * (2 * ew->my + 1);
+  ew->km = realloc(ew->km, sizeof(int) * size);
+  ew->kl = realloc(ew->kl, sizeof(int) * size);
+  ew->kw = realloc(ew->kw, sizeof(double) * size);
+  ew->sk = realloc(ew->sk, sizeof(double) * 2 * size);
+  ew->nk = 0;
+  for (int m = 0; m <= ew->mx; m++) {
+    for (int l = -ew->my; l <= ew->my; l++) {
+      if (m == 0 && l <= 0) { // k and -k contribute alike
+        continue;
+      }
+      double kx = 2 * M_PI * m / lx, ky = 2 * M_PI * l / ly;
+      double k = sqrt(kx * kx + ky * ky);
+      if (k > kc) {
+        continue;
+      }
+      ew->km[ew->nk] = m;
+      ew->kl[ew->nk] = l;
+      ew->kw[ew->nk] = 2 * 2 * M_PI / area * erfc(k / (2 * alpha)) / k;
+      ew->nk++;
+    }
+  }
+  ew->cap = 0; // phase tables change size
+}
+
+// Phase of body i for k vector q
+static inline void ewald_phase(Ewald *ew, int i, int q, double *c, double *s) {
+  const double *ex = ew->ex + 2 * ((size_t)i * (ew->mx + 1) + ew->km[q]);
+  const double *ey =
+      ew->ey + 2 * ((size_t)i * (2 * ew->my + 1) + ew->my + ew->kl[q]);
+  *c = ex[0] * ey[0] - ex[1] * ey[1];
+  *s = ex[0] * ey[1] + ex[1] * ey[0];
+}
+
+// Phase tables by repeated multiplication with e^(i 2 pi x / l)
+void ewald_table_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  Ewald *ew = &ft->ps->ewald;
+  int i0, i1;
+  while (ForceTask_rows(ft, &i0, &i1)) {
+    for (int i = i0; i < i1; i++) {
+      double *ex = ew->ex + 2 * (size_t)i * (ew->mx + 1);
+      double *ey = ew->ey + 2 * (size_t)i * (2 * ew->my + 1) + 2 * ew->my;
+      double cx = cos(2 * M_PI * ft->x[i] / ew->lx);
+      double sx = sin(2 * M_PI * ft->x[i] / ew->lx);
+      double cy = cos(2 * M_PI * ft->y[i] / ew->ly);
+      double sy = sin(2 * M_PI * ft->y[i] / ew->ly);
+      ex[0] = ey[0] = 1;
+      ex[1] = ey[1] = 0;
+      for (int m = 1; m <= ew->mx; m++) {
+        ex[2 * m] = ex[2 * m - 2] * cx - ex[2 * m - 1] * sx;
+        ex[2 * m + 1] = ex[2 * m - 2] * sx + ex[2 * m - 1] * cx;
+      }
+      for (int l = 1; l <= ew->my; l++) {
+        ey[2 * l] = ey[2 * l - 2] * cy - ey[2 * l - 1] * sy;
+        ey[2 * l + 1] = ey[2 * l - 2] * sy + ey[2 * l - 1] * cy;
+        ey[-2 * l] = ey[2 * l];
+        ey[-2 * l + 1] = -ey[2 * l + 1];
+      }
+    }
+  }
+}
+
+// Structure factors, k vectors split between threads
+void ewald_sk_task(void *arg, int tid, int nthreads) {
+  ForceTask *ft = arg;
+  Ewald *ew = &ft->ps->ewald;
+  int n = ft->ps->n;
+  for (int q = ew->nk * tid / nthreads; q < ew->nk * (tid + 1) / nthreads; q++) {
+    double sc = 0, ss = 0;
+    for (int j = 0; j < n; j++) {
+      double c, s;
+      ewald_phase(ew, j, q, &c, &s);
+      sc += c;
+      ss += s;
+    }
+    ew->sk[2 * q] = sc;
+    ew->sk[2 * q + 1] = ss;
+  }
+}
+
+void ewald_task(void *arg, int tid, int nthreads) {
+  (void)(tid);
+  (void)(nthreads);
+  ForceTask *ft = arg;
+  Ewald *ew = &ft->ps->ewald;
+  int i0, i1;
+  while (ForceTask_rows(ft, &i0, &i1)) {
+    for (int i = i0; i < i1; i++) {
+      double fx = 0, fy = 0;
+      for (int q = 0; q < ew->nk; q++) {
+        double c, s;
+        ewald_phase(ew, i, q, &c, &s);
+        // sum_j sin(k (x_j - x_i))
+        double f = ew->kw[q] * (ew->sk[2 * q + 1] * c - ew->sk[2 * q] * s);
+        fx += f * 2 * M_PI * ew->km[q] / ew->lx;
+        fy += f * 2 * M_PI * ew->kl[q] / ew->ly;
+      }
+      ft->ax[i] += ft->C * fx;
+      ft->ay[i] += ft->C * fy;
+    }
+  }
+}
+
+// Periodic forces to a relative tolerance of about 10^-EWALD_DIGITS,
+// O(n^3/2) with the balanced alpha
+void interact_ewald(PSystem *ps, const double *x, const double *y,
+                    double *ax, double *ay, double C) {
+  int digits = EWALD_DIGITS < 1 ? 1 : EWALD_DIGITS > 15 ? 15 : EWALD_DIGITS;
+  Ewald *ew = &ps->ewald;
+  Ewald_prepare(ew, ps->n, pow(10, -digits));
+  if (ps->n > ew->cap) {
+    ew->cap = ps->n;
+    ew->ex = realloc(ew->ex, sizeof(double) * 2 * ps->n * (ew->mx + 1));
+    ew->ey = realloc(ew->ey, sizeof(double) * 2 * ps->n * (2 * ew->my + 1));
+  }
+  Pool_force(ewald_table_task, ps, x, y, ax, ay, C);
+  Pool_force(ewald_sk_task, ps, x, y, ax, ay, C);
+  Pool_force(ewald_task, ps, x, y, ax, ay, C);
+
+  CellList *cl = &ps->cells;
+  CellList_topology(cl);
+  CellList_build(cl, ps->n, x, y, ew->rc);
+  cl->alpha = ew->alpha;
+  Pool_force(cell_task, ps, x, y, ax, ay, C);
+}
+
+void PSystem_scratch(PSystem *ps, int n) {
+  if (n <= ps->scratch) {
+    return;
+  }
+  ps->scratch = n;
+  ps->px = realloc(ps->px, sizeof(double) * n);
+  ps->py = realloc(ps->py, sizeof(double) * n);
+  ps->pax = realloc(ps->pax, sizeof(double) * n);
+  ps->pay = realloc(ps->pay, sizeof(double) * n);
+}
+
+// Tunable parameter of the force engine selected in s
+int *force_param(Settings *s) {
+  static int none = 0;
+  switch (s->FORCE) {
+  case FORCE_BARNES_HUT:
+    return &s->THETA;
+  case FORCE_FMM:
+    return &s->FMM_ORDER;
+  case FORCE_CELLS:
+  case FORCE_VERLET:
+    return &s->CUTOFF;
+  case FORCE_PM:
+    return &s->PM_GRID;
+  case FORCE_P3M:
+    return &s->P3M_SPLIT;
+  case FORCE_EWALD:
+    return &s->EWALD_DIGITS;
+  default:
+    return &none;
+  }
+}
+
+// Interaction engine for FORCE and TOPOLOGY
+InteractFunc interact_select() {
+  switch (FORCE) {
+  case FORCE_SIMD:
+    return interact_simd;
+  case FORCE_TILED:
+    return interact_tiled;
+  case FORCE_BARNES_HUT:
+    return interact_bh;
+  case FORCE_FMM:
+    return interact_fmm;
+  case FORCE_CELLS:
+    return interact_cells;
+  case FORCE_VERLET:
+    return interact_verlet;
+  case FORCE_PM:
+  case FORCE_P3M:
+  case FORCE_EWALD:
+    if (TOPOLOGY != 1) { // periodic solvers, not for the rectangle
+      return interact_direct;
+    }
+    return FORCE == FORCE_PM    ? interact_pm
+           : FORCE == FORCE_P3M ? interact_p3m
+                                : interact_ewald;
+  default:
+    return interact_direct;
+  }
+}
+
+// Body of func() for constant gravity and interact flags; every RHS_VARIANT
+// inlines it, so the disabled force terms compile away
+static inline __attribute__((always_inline)) int
+rhs_eval(const double y[], double dydt[], PSystem *ps, const int gravity,
+         const int interact) {
+  int n = ps->n, cap = ps->cap;
+  ps->stats.evals++;
+
+  // The force kernels work on contiguous positions and accelerations: views
+  // into y and dydt for PS_SOA, packed copies for PS_AOS
+  const double *qx, *qy;
+  double *ax, *ay;
+  if (ps->layout == PS_SOA) {
+    memcpy(dydt, y + 2 * cap, sizeof(double) * 2 * cap); // dx/dt = v
+    qx = y;
+    qy = y + cap;
+    ax = dydt + 2 * cap;
+    ay = dydt + 3 * cap;
+    memset(ax + n, 0, sizeof(double) * (cap - n)); // free slots stay at rest
+    memset(ay + n, 0, sizeof(double) * (cap - n));
+  } else {
+    PSystem_scratch(ps, n);
+    for (int i = 0; i < n; i++) {
+      ps->px[i] = y[4 * i + 0];
+      ps->py[i] = y[4 * i + 2];
+    }
+    qx = ps->px;
+    qy = ps->py;
+    ax = ps->pax;
+    ay = ps->pay;
+  }
+
+  if (gravity) { // Gravity towards center
+    double M = ps->M, e2 = ps->E2;
+    for (int i = 0; i < n; i++) {
+      double f = -M * inv_r3(qx[i] * qx[i] + qy[i] * qy[i] + e2);
+      ax[i] = qx[i] * f;
+      ay[i] = qy[i] * f;
+    }
+  } else {
+    memset(ax, 0, sizeof(double) * n);
+    memset(ay, 0, sizeof(double) * n);
+  }
+
+  if (interact) { // Interactions
+    ps->interact(ps, qx, qy, ax, ay, ps->C);
+  }
+
+  if (ps->layout == PS_AOS) {
+    for (int i = 0; i < n; i++) {
+      dydt[4 * i + 0] = y[4 * i + 1];
+      dydt[4 * i + 1] = ax[i];
+      dydt[4 * i + 2] = y[4 * i + 3];
+      dydt[4 * i + 3] = ay[i];
+    }
+    memset(dydt + 4 * n, 0, sizeof(double) * 4 * (cap - n));
+  }
+  return GSL_SUCCESS;
+}
+
+#define RHS_VARIANT(name, gravity, interact)                                   \
+  int name(double t, const double y[], double dydt[], void *params) {         \
+    (void)(t);                                                                 \
+    return rhs_eval(y, dydt, (PSystem *)params, gravity, interact);           \
+  }
+
+RHS_VARIANT(rhs_free, 0, 0)
+RHS_VARIANT(rhs_gravity, 1, 0)
+RHS_VARIANT(rhs_interact, 0, 1)
+RHS_VARIANT(rhs_both, 1, 1)
+
+// Indexed by (gravity on) + 2 (interactions on)
+const RHSFunc RHS_VARIANTS[] = {rhs_free, rhs_gravity, rhs_interact,
+                                rhs_both};
+
+// Pick the right hand side for the current settings; done once per frame
+void PSystem_select(PSystem *ps) {
+  float M = (float)GRAVITY / 100.0f;
+  float C = 0.01 * INTERACTION;
+  ps->M = M;
+  ps->C = C;
+  ps->E2 = pow(SOFTENING / 100.0, 2);
+  ps->interact = interact_select();
+  ps->rhs = RHS_VARIANTS[(M != 0) + 2 * (C != 0)];
+  if (ps->sys) {
+    ps->sys->function = ps->rhs;
+  }
+  // forces kept for the symplectic steppers go stale with the settings
+  Kick *kk = &ps->kick;
+  Settings st;
+  Settings_get(&st);
+  int param = *force_param(&st);
+  if (kk->M != ps->M || kk->C != ps->C || kk->E2 != ps->E2 ||
+      kk->interact != ps->interact || kk->param != param ||
+      kk->topology != TOPOLOGY || kk->width != screenWidth ||
+      kk->height != screenHeight || kk->stepper != ps->stepper) {
+    kk->M = ps->M;
+    kk->C = ps->C;
+    kk->E2 = ps->E2;
+    kk->interact = ps->interact;
+    kk->param = param;
+    kk->topology = TOPOLOGY;
+    kk->width = screenWidth;
+    kk->height = screenHeight;
+    kk->stepper = ps->stepper;
+    kk->dirty = 1;
+  }
+}
+
+// Evaluate function at time t, state y and store result in dydt, with the
+// settings of the last PSystem_select
+int func(double t, const double y[], double dydt[], void *params) {
+  PSystem *ps = (PSystem *)params;
+  return ps->rhs(t, y, dydt, params);
+}
+
+//
+// Vector Helpers
+
+
+
+//
+Vector2 V(float x, float y) {
+  Vector2 out;
+  out.x = x;
+  out.y = y;
+  return out;
+}
+
+Vector2 Vsum(Vector2 a, Vector2 b) { return V(a.x + b.x, a.y + b.y); }
+
+Vector2 Vdiff(Vector2 a, Vector2 b) { return V(a.x - b.x, a.y - b.y); }
+
+Vector2 Vscale(Vector2 a, float s) { return V(a.x * s, a.y * s); }
+
+// Simulation coordinates around 0. Letter a,b
+Vector2 scr2sim_of(const Settings *st, Vector2 P) {
+  float s = (float)st->SCALE * 20.f + 200;
+  return V((P.x - (float)st->screenWidth / 2) / s,
+           -(P.y - (float)st->screenHeight / 2) / s);
+}
+
+Vector2 sim2scr_of(const Settings *st, Vector2 a) {
+  float s = (float)st->SCALE * 20.f + 200;
+  return V((float)st->screenWidth / 2 + a.x * s,
+           (float)st->screenHeight / 2 - a.y * s);
+}
+
+// Screen of the stepping thread
+Vector2 scr2sim(Vector2 P) {
+  Settings st = {.SCALE = SCALE,
+                 .screenWidth = screenWidth,
+                 .screenHeight = screenHeight};
+  return scr2sim_of(&st, P);
+}
+
+Vector2 sim2scr(Vector2 a) {
+  Settings st = {.SCALE = SCALE,
+                 .screenWidth = screenWidth,
+                 .screenHeight = screenHeight};
+  return sim2scr_of(&st, a);
+}
+//
+// VTail
+//
+
+void VTail_print(VTail *t) {
+  printf("VTail<n=%d,fill=%d,data=%p>", t->n, t->fill, t->data);
+}
+
+VTail *VTail_alloc(int n) {
+  VTail *t = calloc(1, sizeof(VTail));
+  t->n = n;
+  t->fill = 0;
+  t->data = calloc(n, sizeof(Vector2));
+  return t;
+}
+
+void VTail_free(VTail *t) {
+  free(t->data);
+  free(t);
+}
+
+void VTail_clear(VTail *t) { t->fill = 0; }
+
+void VTail_push(VTail *t, Vector2 a) {
+  if (t->n == 0) {
+    return;
+  }
+  // advance elements in t.data
+  for (int tar = t->fill; tar > 0; tar--) {
+    int src = tar - 1;
+    if (src >= 0 && tar < t->n) {
+      t->data[tar] = t->data[src];
+    }
+  }
+  if (t->fill < t->n) {
+    t->fill += 1;
+  }
+  t->data[0] = a;
+}
+
+//
+// Planet
+//
+
+VState VState_new(Vector2 pos, Vector2 vel) {
+  VState s = {pos.x, vel.x, pos.y, vel.y};
+  return s;
+}
+
+Planet *Planet_alloc() {
+  Planet *p = calloc(1, sizeof(Planet));
+  p->tail = VTail_alloc(50);
+  p->color = MAROON;
+  return p;
+}
+
+void Planet_free(Planet *p) {
+  VTail_free(p->tail);
+  free(p);
+}
+
+// Reflect the velocity of a planet at (x, y) off the screen margin if it
+// heads out; returns whether it did. One still outside after a reflection
+// keeps its velocity instead of flipping back and forth.
+int Planet_reflect(double x, double y, double *vx, double *vy) {
+  Vector2 P = sim2scr(V(x, y));
+  int hit = 0;
+  if ((P.x < 10 && *vx < 0) || (P.x > screenWidth - 10 && *vx > 0)) {
+    *vx = -*vx;
+    hit = 1;
+  }
+  if ((P.y < 10 && *vy > 0) || (P.y > screenHeight - 10 && *vy < 0)) {
+    *vy = -*vy; // screen y points down
+    hit = 1;
+  }
+  return hit;
+}
+
+double scr_mod(double x, double sz) {
+  sz = fabs(sz); // sz may be negative
+  double y = fmod(x + sz, 2 * sz) - sz;
+  // fix "quadrant"
+  while (y < -sz)
+    y += 2 * sz;
+  while (y > +sz)
+    y -= 2 * sz;
+  return y;
+}
+
+void Planet_draw(Planet *p, Vector2 pos) {
+  Color c = BLUE;
+  if (UI.INTERACTION < 0) {
+    c = MAROON;
+  }
+  float sz = 0.3f * abs(UI.INTERACTION);
+  DrawCircleV(sim2scr_of(&UI, pos), sz, c);
+
+  int n = p->tail->fill;
+  for (int i = 0; i < n; i++) {
+    float f = 1 - (float)i / (float)n;
+    DrawCircleV(sim2scr_of(&UI, p->tail->data[i]), 1, Fade(c, f));
+  }
+}
+
+//
+// Planet System
+//
+
+PSystem *PSystem_alloc() {
+  PSystem *ps = calloc(1, sizeof(PSystem));
+  ps->stepper = STEPPER;
+  ps->kick.dirty = 1;
+  return ps;
+}
+
+// Free the system with its driver and all engine workspaces
+void PSystem_free(PSystem *ps) {
+  free(ps->state);
+  if (ps->driver) {
+    gsl_odeiv2_driver_free(ps->driver);
+  }
+  free(ps->sys);
+  CellList *cls[] = {&ps->cells, &ps->verlet.cells};
+  for (int k = 0; k < 2; k++) {
+    free(cls[k]->cell);
+    free(cls[k]->start);
+    free(cls[k]->perm);
+    free(cls[k]->sx);
+    free(cls[k]->sy);
+  }
+  Hermite *hm = &ps->hermite;
+  void *buffers[] = {
+      ps->bh.nodes, ps->bh.next,
+      ps->fmm.M, ps->fmm.L, ps->fmm.K, ps->fmm.start, ps->fmm.leaf,
+      ps->fmm.perm,
+      ps->verlet.x0, ps->verlet.y0, ps->verlet.start, ps->verlet.nbr,
+      ps->pm.mesh,
+      ps->ewald.km, ps->ewald.kl, ps->ewald.kw, ps->ewald.ex, ps->ewald.ey,
+      ps->ewald.sk,
+      ps->px, ps->py, ps->pax, ps->pay, ps->acc,
+      ps->jfnk.buf, ps->rk.buf, ps->dopri.buf, ps->abm.buf, ps->kick.f,
+      hm->ax, hm->ay, hm->jx, hm->jy, hm->px, hm->py, hm->pvx, hm->pvy,
+      hm->t, hm->dt, hm->act, hm->na, hm->nj,
+  };
+  for (size_t k = 0; k < sizeof(buffers) / sizeof(buffers[0]); k++) {
+    free(buffers[k]);
+  }
+  free(ps);
+}
+
+// Component arrays of the state: body i is at x[i * stride] etc.
+typedef struct {
+  double *x, *vx, *y, *vy;
+  int stride;
+} PSView;
+
+// View of a state vector s, or of its derivative, in the layout of ps
+PSView PSystem_view_of(PSystem *ps, double *s) {
+  int cap = ps->cap;
+  if (ps->layout == PS_SOA) {
+    PSView v = {s, s + 2 * cap, s + cap, s + 3 * cap, 1};
+    return v;
+  }
+  PSView v = {s + 0, s + 1, s + 2, s + 3, 4};
+  return v;
+}
+
+PSView PSystem_view(PSystem *ps) { return PSystem_view_of(ps, ps->state); }
+
+VState PSystem_get(PSystem *ps, int i) {
+  PSView v = PSystem_view(ps);
+  int k = i * v.stride;
+  VState s = {v.x[k], v.vx[k], v.y[k], v.vy[k]};
+  return s;
+}
+
+void PSystem_set(PSystem *ps, int i, VState s) {
+  PSView v = PSystem_view(ps);
+  int k = i * v.stride;
+  v.x[k] = s.x;
+  v.vx[k] = s.vx;
+  v.y[k] = s.y;
+  v.vy[k] = s.vy;
+}
+
+// Convert the state to PS_AOS or PS_SOA
+void PSystem_layout(PSystem *ps, int layout) {
+  if (layout == ps->layout) {
+    return;
+  }
+  VState *s = malloc(sizeof(VState) * ps->n);
+  for (int i = 0; i < ps->n; i++) {
+    s[i] = PSystem_get(ps, i);
+  }
+  memset(ps->state, 0, sizeof(VState) * ps->cap);
+  ps->layout = layout;
+  for (int i = 0; i < ps->n; i++) {
+    PSystem_set(ps, i, s[i]);
+  }
+  free(s);
+  ps->kick.dirty = 1;
+}
+
+// Evaluate the forces at ps->state if they are stale
+void PSystem_force(PSystem *ps) {
+  Kick *kk = &ps->kick;
+  if (ps->cap > kk->size) {
+    kk->size = ps->cap;
+    kk->f = realloc(kk->f, sizeof(VState) * ps->cap);
+    kk->dirty = 1;
+  }
+  if (kk->dirty) {
+    ps->rhs(0, ps->state, kk->f, ps);
+    kk->dirty = 0;
+  }
+}
+
+void PSystem_print(PSystem *ps) {
+  printf("PSystem<n=%d,state=[", ps->n);
+  for (int i = 0; i < ps->n; i++) {
+    VState s = PSystem_get(ps, i);
+    printf("%.3f,", s.x);
+    printf("%.3f,", s.vx);
+    printf("%.3f,", s.y);
+    printf("%.3f; ", s.vy);
+  }
+  printf("]>\n");
+}
+
+//
+// Jacobian
+//
+// d(dx/dt)/dvx = 1 and the acceleration blocks of the direct force law
+// (the periodic and approximate engines are not differentiated). A pair
+// force C d f with d = x_j - x_i, f = (r^2 + eps^2)^(-3/2) has
+//   K = d(C d f)/dd = C (f I - 3 f / (r^2 + eps^2) d d^T)
+// which enters +K at (i, j) and (j, i) and -K at (i, i) and (j, j); the sun
+// gives -M K at (i, i) with d the position.
+//
+
+// State index of component c (0: x, 1: vx, 2: y, 3: vy) of body i
+static inline int PSystem_index(PSystem *ps, int i, int c) {
+  static const int soa[4] = {0, 2, 1, 3};
+  return ps->layout == PS_SOA ? soa[c] * ps->cap + i : 4 * i + c;
+}
+
+// Add the block s K(dx, dy) to the rows of the accelerations of body i and
+// the columns of the position of body j
+static inline void jac_block(gsl_matrix *m, PSystem *ps, int i, int j,
+                             double s, double kxx, double kxy, double kyy) {
+  int vx = PSystem_index(ps, i, 1), vy = PSystem_index(ps, i, 3);
+  int x = PSystem_index(ps, j, 0), y = PSystem_index(ps, j, 2);
+  m->data[vx * m->tda + x] += s * kxx;
+  m->data[vx * m->tda + y] += s * kxy;
+  m->data[vy * m->tda + x] += s * kxy;
+  m->data[vy * m->tda + y] += s * kyy;
+}
+
+int jac(double t, const double y[], double *dfdy, double dfdt[],
+        void *params) {
+  (void)(t);
+  PSystem *ps = (PSystem *)params;
+  int n = ps->n, dim = 4 * ps->cap;
+  gsl_matrix_view dm = gsl_matrix_view_array(dfdy, dim, dim);
+  gsl_matrix *m = &dm.matrix;
+  gsl_matrix_set_zero(m);
+  memset(dfdt, 0, sizeof(double) * dim);
+  ps->stats.jacobians++;
+
+  for (int i = 0; i < n; i++) {
+    m->data[PSystem_index(ps, i, 0) * m->tda + PSystem_index(ps, i, 1)] = 1;
+    m->data[PSystem_index(ps, i, 2) * m->tda + PSystem_index(ps, i, 3)] = 1;
+  }
+  double M = ps->M, C = ps->C, e2 = ps->E2;
+  for (int i = 0; i < n; i++) {
+    double xi = y[PSystem_index(ps, i, 0)], yi = y[PSystem_index(ps, i, 2)];
+    if (M != 0) {
+      double s2 = xi * xi + yi * yi + e2, f = inv_r3(s2), g = 3 * f / s2;
+      jac_block(m, ps, i, i, -M, f - g * xi * xi, -g * xi * yi,
+                f - g * yi * yi);
+    }
+    for (int j = 0; C != 0 && j < i; j++) {
+      double dx = y[PSystem_index(ps, j, 0)] - xi;
+      double dy = y[PSystem_index(ps, j, 2)] - yi;
+      double s2 = dx * dx + dy * dy + e2, f = inv_r3(s2), g = 3 * f / s2;
+      if (f == 0) {
+        continue;
+      }
+      double kxx = f - g * dx * dx, kxy = -g * dx * dy, kyy = f - g * dy * dy;
+      jac_block(m, ps, i, j, C, kxx, kxy, kyy);
+      jac_block(m, ps, j, i, C, kxx, kxy, kyy);
+      jac_block(m, ps, i, i, -C, kxx, kxy, kyy);
+      jac_block(m, ps, j, j, -C, kxx, kxy, kyy);
+    }
+  }
+  return GSL_SUCCESS;
+}
+
+const gsl_odeiv2_step_type *stepper_type(int stepper) {
+  switch (stepper) {
+  case STEP_RKF45:
+    return gsl_odeiv2_step_rkf45;
+  case STEP_RK8PD:
+    return gsl_odeiv2_step_rk8pd;
+  case STEP_BSIMP:
+    return gsl_odeiv2_step_bsimp;
+  case STEP_MSBDF:
+    return gsl_odeiv2_step_msbdf;
+  default:
+    return gsl_odeiv2_step_rk4;
+  }
+}
+
+// Whether the GSL stepper factors the dense Jacobian. The state of these is
+// kept at exactly n bodies, so that jac and the LU cost O(n^2) and O(n^3)
+// in the bodies rather than in the capacity.
+int stepper_dense(int stepper) {
+  return stepper == STEP_BSIMP || stepper == STEP_MSBDF;
+}
+
+//
+// Jacobian-free Newton-Krylov
+//
+// Implicit trapezoidal substeps y1 = y0 + h/2 (f(y0) + f(y1)), solved by
+// Newton's method on G(y1) = 0. Each Newton step solves
+//   (I - h/2 J) dy = -G
+// by GMRES, which needs only products J v ~ (f(y + e v) - f(y)) / e, one
+// RHS evaluation each, so memory and work stay O(n) per evaluation.
+// The local error is estimated from the explicit AB2 predictor, which also
+// seeds Newton (TR-AB2), and h is controlled to the driver's tolerance.
+// Substeps that do not converge are halved and retried. The slope at the
+// start is ps->kick.f, and whatever dirties it also restarts the predictor.
+//
+
+#define JFNK_KRYLOV 30   // GMRES basis size, no restarts
+#define JFNK_NEWTON 8    // Newton iterations per substep
+#define JFNK_TOL 1e-8    // Newton tolerance, relative to 1 + |y|
+#define JFNK_FORCING 1e-3 // GMRES tolerance relative to |G|
+#define JFNK_EPS 1e-5    // local error tolerance, as for the GSL driver
+
+static double vec_dot(int n, const double *a, const double *b) {
+  double s = 0;
+  for (int i = 0; i < n; i++) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+
+static double vec_max(int n, const double *a) {
+  double m = 0;
+  for (int i = 0; i < n; i++) {
+    m = fmax(m, fabs(a[i]));
+  }
+  return m;
+}
+
+// Solve (I - h/2 J) x = b at y with f = f(y) by GMRES from x = 0; w is a
+// scratch vector
+void jfnk_gmres(PSystem *ps, double h, const double *y, const double *f,
+                const double *b, double *x, double *w) {
+  JFNK *jk = &ps->jfnk;
+  int dim = jk->dim, m = JFNK_KRYLOV;
+  double *V = jk->buf + 8 * (size_t)dim; // m + 1 basis vectors
+  double H[JFNK_KRYLOV + 1][JFNK_KRYLOV], cs[JFNK_KRYLOV], sn[JFNK_KRYLOV];
+  double g[JFNK_KRYLOV + 1] = {0};
+  double beta = sqrt(vec_dot(dim, b, b)), ynorm = sqrt(vec_dot(dim, y, y));
+  memset(x, 0, sizeof(double) * dim);
+  if (beta == 0) {
+    return;
+  }
+  for (int i = 0; i < dim; i++) {
+    V[i] = b[i] / beta;
+  }
+  g[0] = beta;
+  int k;
+  for (k = 0; k < m; k++) {
+    double *v = V + (size_t)k * dim, *vn = v + dim;
+    // vn = v - h/2 J v
+    double e = 1e-8 * (1 + ynorm);
+    for (int i = 0; i < dim; i++) {
+      w[i] = y[i] + e * v[i];
+    }
+    ps->rhs(0, w, vn, ps);
+    for (int i = 0; i < dim; i++) {
+      vn[i] = v[i] - h / 2 * (vn[i] - f[i]) / e;
+    }
+    jk->krylov++;
+    // modified Gram-Schmidt
+    for (int j = 0; j <= k; j++) {
+      double *vj = V + (size_t)j * dim;
+      H[j][k] = vec_dot(dim, vn, vj);
+      for (int i = 0; i < dim; i++) {
+        vn[i] -= H[j][k] * vj[i];
+      }
+    }
+    H[k + 1][k] = sqrt(vec_dot(dim, vn, vn));
+    if (H[k + 1][k] > 0) {
+      for (int i = 0; i < dim; i++) {
+        vn[i] /= H[k + 1][k];
+      }
+    }
+    // Givens rotations keep H upper triangular and g the residual
+    for (int j = 0; j < k; j++) {
+      double t = cs[j] * H[j][k] + sn[j] * H[j + 1][k];
+      H[j + 1][k] = -sn[j] * H[j][k] + cs[j] * H[j + 1][k];
+      H[j][k] = t;
+    }
+    double r = hypot(H[k][k], H[k + 1][k]);
+    cs[k] = H[k][k] / r;
+    sn[k] = H[k + 1][k] / r;
+    H[k][k] = r;
+    g[k + 1] = -sn[k] * g[k];
+    g[k] *= cs[k];
+    if (fabs(g[k + 1]) <= JFNK_FORCING * beta || H[k + 1][k] == 0) {
+      k++;
+      break;
+    }
+  }
+  // back substitution, x = V c
+  double c[JFNK_KRYLOV];
+  for (int j = k - 1; j >= 0; j--) {
+    c[j] = g[j];
+    for (int l = j + 1; l < k; l++) {
+      c[j] -= H[j][l] * c[l];
+    }
+    c[j] /= H[j][j];
+  }
+  for (int j = 0; j < k; j++) {
+    const double *vj = V + (size_t)j * dim;
+    for (int i = 0; i < dim; i++) {
+      x[i] += c[j] * vj[i];
+    }
+  }
+}
+
+// One trapezoidal substep of size h from y0 with f0 = f(y0) into y1 and
+// f1 = f(y1), starting Newton from the guess in y1; returns 0 if Newton
+// does not converge
+int jfnk_substep(PSystem *ps, double h, const double *y0, const double *f0,
+                 double *y1, double *f1) {
+  JFNK *jk = &ps->jfnk;
+  int dim = jk->dim;
+  double *G = jk->buf + 4 * (size_t)dim, *dy = G + dim;
+  double *w = jk->buf + (8 + JFNK_KRYLOV + 1) * (size_t)dim;
+  for (int it = 0; it < JFNK_NEWTON; it++) {
+    ps->rhs(0, y1, f1, ps);
+    for (int i = 0; i < dim; i++) {
+      G[i] = y1[i] - y0[i] - h / 2 * (f0[i] + f1[i]);
+    }
+    if (vec_max(dim, G) <= JFNK_TOL * (1 + vec_max(dim, y1))) {
+      return 1;
+    }
+    jk->newton++;
+    for (int i = 0; i < dim; i++) {
+      G[i] = -G[i];
+    }
+    jfnk_gmres(ps, h, y1, f1, G, dy, w);
+    for (int i = 0; i < dim; i++) {
+      y1[i] += dy[i];
+    }
+  }
+  return 0;
+}
+
+// Advance ps->state by STEP; returns the time reached
+double JFNK_step(PSystem *ps) {
+  JFNK *jk = &ps->jfnk;
+  int dim = 4 * ps->cap;
+  if (dim != jk->dim) {
+    jk->dim = dim;
+    jk->buf = realloc(jk->buf, sizeof(double) * dim * (10 + JFNK_KRYLOV));
+    jk->hp = 0;
+  }
+  if (jk->h <= 0) {
+    jk->h = STEP / 16;
+  }
+  if (ps->kick.dirty) { // moved outside the stepper: fp is of another state
+    jk->hp = 0;
+  }
+  PSystem_force(ps);
+  double *y0 = jk->buf, *f0 = y0 + dim, *y1 = f0 + dim, *f1 = y1 + dim;
+  double *fp = jk->buf + 6 * (size_t)dim, *yp = fp + dim;
+  memcpy(y0, ps->state, sizeof(double) * dim);
+  memcpy(f0, ps->kick.f, sizeof(double) * dim);
+  double t = 0;
+  while (t < STEP) {
+    double rest = STEP - t, h = fmin(jk->h, rest);
+    // AB2 predictor from the previous slope, or Euler without history.
+    // Their local errors are 5/12 and 1/2 of h^3 y''' and h^2 y'', so the
+    // trapezoidal error -1/12 h^3 y''' is (y1 - yp) / c.
+    double r = jk->hp > 0 ? h / jk->hp : 0, c = 2;
+    for (int i = 0; i < dim; i++) {
+      yp[i] = y0[i] + h * f0[i] + h * r / 2 * (f0[i] - fp[i]);
+    }
+    if (jk->hp > 0) {
+      c = 3 * (1 + jk->hp / h);
+    }
+    memcpy(y1, yp, sizeof(double) * dim);
+    if (!jfnk_substep(ps, h, y0, f0, y1, f1)) {
+      jk->failed++;
+      jk->h = h / 2;
+      if (jk->h < 1e-9) {
+        break;
+      }
+      continue;
+    }
+    double err = 0;
+    for (int i = 0; i < dim; i++) {
+      double e = fabs(y1[i] - yp[i]) / c;
+      err = fmax(err, e / (JFNK_EPS * (1 + fabs(y1[i]))));
+    }
+    double grow = 0.9 * pow(fmax(err, 1e-10), -1.0 / 3);
+    jk->h = h * fmin(fmax(grow, 0.2), 5);
+    if (err > 1) {
+      jk->failed++;
+      continue;
+    }
+    jk->steps++;
+    jk->hp = h;
+    t = h == rest ? STEP : t + h;
+    memcpy(fp, f0, sizeof(double) * dim);
+    memcpy(y0, y1, sizeof(double) * dim);
+    memcpy(f0, f1, sizeof(double) * dim);
+  }
+  memcpy(ps->state, y0, sizeof(double) * dim);
+  memcpy(ps->kick.f, f0, sizeof(double) * dim);
+  return t;
+}
+
+//
+// Fixed-step Runge-Kutta
+//
+// The explicit midpoint rule and classical rk4 in SUBSTEPS steps per frame
+// without error control: 2 and 4 RHS evaluations per step, against about
+// 11 per accepted step of gsl_odeiv2_step_rk4, whose error estimate takes
+// two more half steps. Only for scenes soft enough for the chosen step.
+//
+
+// Order of a fixed-step Runge-Kutta stepper, or 0
+int stepper_rk_order(int stepper) {
+  switch (stepper) {
+  case STEP_RK2_FIXED:
+    return 2;
+  case STEP_RK4_FIXED:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+// One classical rk4 step of y from f0 = f(y), with the work vectors sum,
+// yt and k of the state size; f0 may be k
+void rk4_substep(PSystem *ps, double h, double *y, const double *f0,
+                 double *sum, double *yt, double *k) {
+  int dim = 4 * ps->cap;
+  // stages at t, t + h/2, t + h/2 and t + h, weighted 1/6, 1/3, 1/3, 1/6
+  const double a[] = {0.5, 0.5, 1}, b[] = {1.0 / 6, 1.0 / 3, 1.0 / 3};
+  for (int j = 0; j < 3; j++) {
+    const double *kj = j ? k : f0;
+    for (int i = 0; i < dim; i++) {
+      sum[i] = (j ? sum[i] : y[i]) + b[j] * h * kj[i];
+      yt[i] = y[i] + a[j] * h * kj[i];
+    }
+    ps->rhs(0, yt, k, ps);
+  }
+  for (int i = 0; i < dim; i++) {
+    y[i] = sum[i] + h / 6 * k[i];
+  }
+}
+
+// Advance ps->state by STEP; returns the time reached
+double FixedRK_step(PSystem *ps, int order) {
+  FixedRK *rk = &ps->rk;
+  int dim = 4 * ps->cap;
+  if (dim != rk->dim) {
+    rk->dim = dim;
+    rk->buf = realloc(rk->buf, sizeof(double) * 3 * dim);
+  }
+  double *y = ps->state, *sum = rk->buf, *yt = sum + dim, *k = yt + dim;
+  int steps = SUBSTEPS < 1 ? 1 : SUBSTEPS;
+  double h = STEP / steps;
+  for (int s = 0; s < steps; s++) {
+    ps->rhs(0, y, k, ps);
+    if (order == 2) {
+      for (int i = 0; i < dim; i++) {
+        yt[i] = y[i] + h / 2 * k[i];
+      }
+      ps->rhs(0, yt, k, ps);
+      for (int i = 0; i < dim; i++) {
+        y[i] += h * k[i];
+      }
+      continue;
+    }
+    rk4_substep(ps, h, y, k, sum, yt, k);
+  }
+  return STEP;
+}
+
+//
+// Symplectic steppers
+//
+// Splitting methods in SUBSTEPS fixed steps h per frame, made of kicks
+// v += c h a(x) and drifts x += c h v. Kick-drift-kick leapfrog is
+//   v += h/2 a(x), x += h v, v += h/2 a(x)
+// and the higher orders compose it (Yoshida's triple jump and his order 6
+// solution A) or are fitted directly (PEFRL, Omelyan et al. 2002).
+// Forest-Ruth has the coefficients of the triple jump but starts with a
+// drift. Forces are evaluated only at kicks after a drift: the closing kick
+// of a step shares its forces with the opening kick of the next.
+// ps->kick keeps them across frames; anything else that moves the bodies
+// or changes the force law marks them dirty.
+//
+
+// Palindromic sequence of alternating kick and drift coefficients
+typedef struct {
+  int order;
+  int kick_first; // starts with a kick, or with a drift
+  int m;          // number of coefficients
+  double c[15];
+} Splitting;
+
+const Splitting SPLITTINGS[] = { // from STEP_LEAPFROG on
+    {2, 1, 3, {0.5, 1, 0.5}},
+    {4, 1, 7,
+     {0.6756035959798289, 1.3512071919596578, -0.17560359597982889,
+      -1.7024143839193155, -0.17560359597982889, 1.3512071919596578,
+      0.6756035959798289}},
+    {6, 1, 15,
+     {0.39225680523878, 0.78451361047756, 0.5100434119184585,
+      0.235573213359357, -0.47105338540975655, -1.17767998417887,
+      0.0687531682525181, 1.3151863206839063, 0.0687531682525181,
+      -1.17767998417887, -0.47105338540975655, 0.235573213359357,
+      0.5100434119184585, 0.78451361047756, 0.39225680523878}},
+    {4, 0, 7,
+     {0.6756035959798289, 1.3512071919596578, -0.17560359597982889,
+      -1.7024143839193155, -0.17560359597982889, 1.3512071919596578,
+      0.6756035959798289}},
+    {4, 0, 9,
+     {0.1786178958448091, 0.7123418310626054, -0.0662645826698185,
+      -0.2123418310626054, 0.7752933736500187, -0.2123418310626054,
+      -0.0662645826698185, 0.7123418310626054, 0.1786178958448091}},
+};
+
+// Splitting of a symplectic stepper, or NULL
+const Splitting *stepper_splitting(int stepper) {
+  if (stepper < STEP_LEAPFROG || stepper > STEP_PEFRL) {
+    return NULL;
+  }
+  return &SPLITTINGS[stepper - STEP_LEAPFROG];
+}
+
+void PSystem_kick(PSystem *ps, double h) {
+  PSystem_force(ps);
+  PSView v = PSystem_view(ps), a = PSystem_view_of(ps, ps->kick.f);
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    v.vx[k] += h * a.vx[k];
+    v.vy[k] += h * a.vy[k];
+  }
+}
+
+void PSystem_drift(PSystem *ps, double h) {
+  PSView v = PSystem_view(ps);
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    v.x[k] += h * v.vx[k];
+    v.y[k] += h * v.vy[k];
+  }
+  ps->kick.dirty = 1;
+}
+
+// Advance ps->state by STEP; returns the time reached
+double Symplectic_step(PSystem *ps, const Splitting *sp) {
+  int steps = SUBSTEPS < 1 ? 1 : SUBSTEPS;
+  double h = STEP / steps;
+  for (int s = 0; s < steps; s++) {
+    for (int i = s > 0; i < sp->m; i++) { // the first joins the last
+      double c = sp->c[i];
+      if (i == sp->m - 1 && s < steps - 1) {
+        c += sp->c[0];
+      }
+      if ((i % 2 == 0) == sp->kick_first) {
+        PSystem_kick(ps, c * h);
+      } else {
+        PSystem_drift(ps, c * h);
+      }
+    }
+  }
+  return STEP;
+}
+
+//
+// Dormand-Prince
+//
+// Embedded 5(4) pair of Dormand & Prince (1980), advancing the 5th order
+// solution. Its last stage is f at the solution, so an accepted step costs
+// 6 RHS evaluations: the slope at the start is ps->kick.f, kept across
+// steps and frames like the forces of the symplectic steppers. The step
+// follows the PI controller of Hairer & Wanner's DOPRI5,
+//   h' = h 0.9 err^-0.17 err_prev^0.04,
+// bounded to [0.2 h, 10 h], and does not grow right after a rejection.
+//
+
+#define DOPRI_EPS 1e-5 // absolute error per step, as for the GSL driver
+
+const double DOPRI_A[6][6] = {
+    {1.0 / 5},
+    {3.0 / 40, 9.0 / 40},
+    {44.0 / 45, -56.0 / 15, 32.0 / 9},
+    {19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729},
+    {9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176,
+     -5103.0 / 18656},
+    {35.0 / 384, 0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84},
+};
+// 5th minus 4th order weights
+const double DOPRI_E[7] = {71.0 / 57600,      0,           -71.0 / 16695,
+                           71.0 / 1920,       -17253.0 / 339200,
+                           22.0 / 525,        -1.0 / 40};
+
+// Advance ps->state by STEP; returns the time reached
+double DOPRI5_step(PSystem *ps) {
+  DOPRI5 *dp = &ps->dopri;
+  int dim = 4 * ps->cap;
+  if (dim != dp->dim) {
+    dp->dim = dim;
+    dp->buf = realloc(dp->buf, sizeof(double) * 8 * dim);
+  }
+  if (dp->h <= 0) {
+    dp->h = STEP / 16;
+    dp->err = 1;
+  }
+  PSystem_force(ps);
+  double *y = ps->state, *k[7], *yt = dp->buf + 6 * (size_t)dim,
+         *y1 = yt + dim;
+  k[0] = ps->kick.f;
+  for (int j = 1; j < 7; j++) {
+    k[j] = dp->buf + (j - 1) * (size_t)dim;
+  }
+  double t = 0;
+  while (t < STEP) {
+    double rest = STEP - t, h = fmin(dp->h, rest);
+    for (int s = 0; s < 6; s++) { // the last stage state is the solution
+      double *ys = s < 5 ? yt : y1;
+      for (int i = 0; i < dim; i++) {
+        double d = 0;
+        for (int j = 0; j <= s; j++) {
+          d += DOPRI_A[s][j] * k[j][i];
+        }
+        ys[i] = y[i] + h * d;
+      }
+      ps->rhs(0, ys, k[s + 1], ps);
+    }
+    double err = 0;
+    for (int i = 0; i < dim; i++) {
+      double e = 0;
+      for (int j = 0; j < 7; j++) {
+        e += DOPRI_E[j] * k[j][i];
+      }
+      err = fmax(err, fabs(h * e) / DOPRI_EPS);
+    }
+    if (!(err <= 1)) { // also for NaN
+      dp->failed++;
+      dp->rejected = 1;
+      dp->h = h * fmax(0.2, 0.9 * pow(fmax(err, 1e-10), -0.2));
+      if (!(dp->h > 1e-9)) {
+        break;
+      }
+      continue;
+    }
+    double fac = 0.9 * pow(fmax(err, 1e-10), -0.17) * pow(dp->err, 0.04);
+    fac = fmin(fmax(fac, 0.2), dp->rejected ? 1 : 10);
+    // a step cut short at the end of the frame keeps the longer one
+    dp->h = h < dp->h && fac >= 1 ? dp->h : h * fac;
+    dp->err = fmax(err, 1e-4);
+    dp->rejected = 0;
+    dp->steps++;
+    t = h == rest ? STEP : t + h;
+    memcpy(y, y1, sizeof(double) * dim);
+    memcpy(k[0], k[6], sizeof(double) * dim); // first same as last
+  }
+  return t;
+}
+
+//
+// Adams-Bashforth-Moulton
+//
+// Multistep predictor-corrector in SUBSTEPS fixed steps h per frame, in
+// backward differences of the slopes f_n, f_n-1, ..: the Adams-Bashforth
+// predictor of order k and the Adams-Moulton corrector of order k + 1,
+//   p = y_n + h sum_j<k g_j D^j f_n,   y_n+1 = p + h g_k D^k f(p),
+// where D^k f(p) takes f(p) as f_n+1 (Hairer, Norsett & Wanner, III.1).
+// abm evaluates f(y_n+1) for the history (PECE, 2 RHS evaluations per
+// step), abm-pec keeps f(p) (PEC, 1 evaluation). The corrector of order
+// q errs by about h g*_q D^q f; each step compares the estimates of the
+// orders k - 1, k and k + 1 and moves to the smallest.
+//
+// The history assumes a smooth solution: when anything outside the stepper
+// moves the bodies or changes the forces (adding planets, reflections at
+// Planet_reflect, the settings), ps->kick is marked dirty and the method
+// restarts. Classical rk4 steps fill the first ABM_START slopes, so that
+// the restart does not cost accuracy, then the order grows by one per
+// step until the history is long enough to compare orders. ps->kick.f
+// holds the newest slope of the history.
+//
+
+// Adams-Bashforth g_j and Adams-Moulton g*_j coefficients. The sums over
+// differences are taken over the slopes directly, D^d f_n = sum_i
+// ABM_D[d][i] f_n-i, and the predictor of order k is sum_i ABM_P[k][i]
+// f_n-i.
+double ABM_G[ABM_ORDER + 3], ABM_GS[ABM_ORDER + 3];
+double ABM_D[ABM_ORDER + 3][ABM_ORDER + 3];
+double ABM_P[ABM_ORDER + 1][ABM_ORDER];
+
+void abm_coefficients() {
+  for (int j = 0; j < ABM_ORDER + 3; j++) {
+    ABM_G[j] = 1;
+    ABM_GS[j] = j == 0;
+    for (int i = 0; i < j; i++) {
+      ABM_G[j] -= ABM_G[i] / (j + 1 - i);
+      ABM_GS[j] -= ABM_GS[i] / (j + 1 - i);
+    }
+    ABM_D[j][0] = 1; // (-1)^i binomial(j, i)
+    for (int i = 1; i <= j; i++) {
+      ABM_D[j][i] = -ABM_D[j][i - 1] * (j - i + 1) / i;
+    }
+  }
+  for (int k = 1; k <= ABM_ORDER; k++) {
+    for (int j = 0; j < k; j++) {
+      for (int i = 0; i <= j; i++) {
+        ABM_P[k][i] += ABM_G[j] * ABM_D[j][i];
+      }
+    }
+  }
+}
+
+// Advance ps->state by STEP; returns the time reached
+double ABM_step(PSystem *ps, int pece) {
+  ABM *ab = &ps->abm;
+  int dim = 4 * ps->cap, H = ABM_ORDER + 1;
+  int steps = SUBSTEPS < 1 ? 1 : SUBSTEPS;
+  double h = STEP / steps;
+  if (ABM_G[0] == 0) {
+    abm_coefficients();
+  }
+  if (dim != ab->dim) {
+    ab->dim = dim;
+    ab->buf = realloc(ab->buf, sizeof(double) * (H + 3) * dim);
+    for (int j = 0; j < H; j++) {
+      ab->f[j] = ab->buf + j * (size_t)dim;
+    }
+    ab->m = 0;
+  }
+  if (ps->kick.dirty || ab->m == 0 || ab->h != h) { // restart
+    PSystem_force(ps);
+    memcpy(ab->f[0], ps->kick.f, sizeof(double) * dim);
+    ab->m = ab->order = 1;
+    ab->h = h;
+    ab->restarts++;
+  }
+  double *y = ps->state, *p = ab->buf + H * (size_t)dim, *fp = p + dim;
+  double *sum = fp + dim, v[ABM_ORDER + 3];
+  for (int s = 0; s < steps; s++) {
+    int k = ab->order, m = ab->m, nd = m + 1 < k + 3 ? m + 1 : k + 3;
+    if (m < ABM_START) {
+      rk4_substep(ps, h, y, ab->f[0], sum, p, fp);
+      double *f1 = ab->f[H - 1];
+      memmove(ab->f + 1, ab->f, sizeof(double *) * (H - 1));
+      ab->f[0] = f1;
+      ps->rhs(0, y, f1, ps);
+      ab->m = ab->order = m + 1;
+      ab->steps++;
+      ab->orders += 4;
+      continue;
+    }
+    const double *P = ABM_P[k];
+    for (int i = 0; i < dim; i++) {
+      double d = 0;
+      for (int j = 0; j < k; j++) {
+        d += P[j] * ab->f[j][i];
+      }
+      p[i] = y[i] + h * d;
+    }
+    ps->rhs(0, p, fp, ps);
+    // correct, with the errors of the correctors of order k, k + 1, k + 2
+    double err[3] = {0};
+    for (int i = 0; i < dim; i++) {
+      v[0] = fp[i];
+      for (int j = 1; j < nd; j++) {
+        v[j] = ab->f[j - 1][i];
+      }
+      for (int q = 0; k + q < nd; q++) {
+        const double *D = ABM_D[k + q];
+        double d = 0;
+        for (int j = 0; j <= k + q; j++) {
+          d += D[j] * v[j];
+        }
+        if (q == 0) {
+          y[i] = p[i] + h * ABM_G[k] * d;
+        }
+        err[q] = fmax(err[q], fabs(ABM_GS[k + q] * d));
+      }
+    }
+    double *f1 = ab->f[H - 1];
+    memmove(ab->f + 1, ab->f, sizeof(double *) * (H - 1));
+    ab->f[0] = f1;
+    if (pece) {
+      ps->rhs(0, y, f1, ps);
+    } else {
+      memcpy(f1, fp, sizeof(double) * dim);
+    }
+    ab->m = m < H ? m + 1 : H;
+    // order k + 1 while the history is too short to judge order k
+    if (k + 1 >= nd) {
+      k = k < ABM_ORDER ? k + 1 : k;
+    } else if (k > 1 && err[0] <= err[1]) {
+      k--;
+    } else if (k < ABM_ORDER && k + 2 < nd && err[2] < err[1]) {
+      k++;
+    }
+    ab->orders += ab->order;
+    ab->order = k;
+    ab->steps++;
+  }
+  memcpy(ps->kick.f, ab->f[0], sizeof(double) * dim);
+  return STEP;
+}
+
+//
+// Hermite block time steps
+//
+// Fourth order Hermite predictor-corrector (Makino & Aarseth 1992) on the
+// direct force law. Each body has its own step STEP / 2^k, from Aarseth's
+// criterion on its acceleration a, jerk j and their derivatives. At each
+// block time only the bodies due there are corrected, with forces from the
+// predicted state of all others, so a close encounter no longer sets the
+// step of every body. Steps may halve at any time and double where the
+// body's time is a multiple of the doubled step; all bodies meet at the
+// end of the frame. Anything else that changes the state restarts the
+// scheme through ps->kick.dirty.
+//
+
+#define HERMITE_LEVELS 24 // steps down to STEP / 2^(HERMITE_LEVELS - 1)
+#define HERMITE_ETA 0.02  // accuracy parameter
+// First step eta |a| / |j|; well below the usual 0.01 since |a| / |j|
+// misses pairs that are approaching
+#define HERMITE_ETA_START 0.002
+
+void Hermite_reserve(Hermite *hm, int n) {
+  if (n <= hm->size) {
+    return;
+  }
+  hm->size = n;
+  double **d[] = {&hm->ax, &hm->ay, &hm->jx, &hm->jy,
+                  &hm->px, &hm->py, &hm->pvx, &hm->pvy};
+  for (int k = 0; k < 8; k++) {
+    *d[k] = realloc(*d[k], sizeof(double) * n);
+  }
+  hm->na = realloc(hm->na, sizeof(double) * 2 * n);
+  hm->nj = realloc(hm->nj, sizeof(double) * 2 * n);
+  hm->t = realloc(hm->t, sizeof(int) * n);
+  hm->dt = realloc(hm->dt, sizeof(int) * n);
+  hm->act = realloc(hm->act, sizeof(int) * n);
+}
+
+// Acceleration and jerk of body i at the predicted state. A pair with
+// d = x_j - x_i, u = v_j - v_i and s^2 = r^2 + eps^2 contributes
+//   a = C d / s^3, j = C (u / s^3 - 3 (d.u) d / s^5)
+static void hermite_body(PSystem *ps, int i, double *a, double *j) {
+  Hermite *hm = &ps->hermite;
+  double M = ps->M, C = ps->C, e2 = ps->E2;
+  double x = hm->px[i], y = hm->py[i], vx = hm->pvx[i], vy = hm->pvy[i];
+  double ax = 0, ay = 0, jx = 0, jy = 0;
+  if (M != 0) {
+    double s2 = x * x + y * y + e2, f = inv_r3(s2);
+    double g = s2 > 0 ? 3 * (x * vx + y * vy) / s2 : 0;
+    ax = -M * x * f;
+    ay = -M * y * f;
+    jx = -M * f * (vx - g * x);
+    jy = -M * f * (vy - g * y);
+  }
+  for (int k = 0; C != 0 && k < ps->n; k++) {
+    double dx = hm->px[k] - x, dy = hm->py[k] - y;
+    double ux = hm->pvx[k] - vx, uy = hm->pvy[k] - vy;
+    double s2 = dx * dx + dy * dy + e2, f = inv_r3(s2);
+    if (f == 0) {
+      continue;
+    }
+    double g = 3 * (dx * ux + dy * uy) / s2;
+    ax += C * dx * f;
+    ay += C * dy * f;
+    jx += C * f * (ux - g * dx);
+    jy += C * f * (uy - g * dy);
+  }
+  a[0] = ax;
+  a[1] = ay;
+  j[0] = jx;
+  j[1] = jy;
+}
+
+void hermite_task(void *arg, int tid, int nthreads) {
+  PSystem *ps = arg;
+  Hermite *hm = &ps->hermite;
+  int m = hm->nact;
+  for (int k = m * tid / nthreads; k < m * (tid + 1) / nthreads; k++) {
+    hermite_body(ps, hm->act[k], hm->na + 2 * k, hm->nj + 2 * k);
+  }
+}
+
+// New forces of the active bodies
+void Hermite_forces(PSystem *ps) {
+  Hermite *hm = &ps->hermite;
+  if ((long)hm->nact * ps->n < 4096) { // not worth waking the pool
+    hermite_task(ps, 0, 1);
+  } else {
+    Pool_run(hermite_task, ps, Pool_threads());
+  }
+  hm->forces += hm->nact;
+}
+
+// Largest block step of at most dt (in ticks) that keeps body i aligned
+static int hermite_block(Hermite *hm, int i, double dt) {
+  int T = 1 << (HERMITE_LEVELS - 1), b = 1;
+  while (b < T && 2 * b <= dt) {
+    b *= 2;
+  }
+  if (b > 2 * hm->dt[i]) { // grow by one level at a time
+    b = 2 * hm->dt[i];
+  }
+  if (b > hm->dt[i] && hm->t[i] % b != 0) {
+    b = hm->dt[i];
+  }
+  return b;
+}
+
+// Advance ps->state by STEP; returns the time reached
+double Hermite_step(PSystem *ps) {
+  Hermite *hm = &ps->hermite;
+  int n = ps->n, T = 1 << (HERMITE_LEVELS - 1);
+  double tick = STEP / T;
+  long forces = hm->forces;
+  if (n > hm->size) {
+    Hermite_reserve(hm, n);
+    ps->kick.dirty = 1;
+  }
+  PSView v = PSystem_view(ps);
+  for (int i = 0; i < n; i++) {
+    int k = i * v.stride;
+    hm->px[i] = v.x[k];
+    hm->py[i] = v.y[k];
+    hm->pvx[i] = v.vx[k];
+    hm->pvy[i] = v.vy[k];
+    hm->t[i] = 0;
+  }
+  if (ps->kick.dirty) { // start: forces of all bodies, steps from |a| / |j|
+    hm->nact = n;
+    for (int i = 0; i < n; i++) {
+      hm->act[i] = i;
+    }
+    Hermite_forces(ps);
+    for (int i = 0; i < n; i++) {
+      hm->ax[i] = hm->na[2 * i];
+      hm->ay[i] = hm->na[2 * i + 1];
+      hm->jx[i] = hm->nj[2 * i];
+      hm->jy[i] = hm->nj[2 * i + 1];
+      double a = hypot(hm->ax[i], hm->ay[i]), j = hypot(hm->jx[i], hm->jy[i]);
+      hm->dt[i] = T; // any step is aligned at tick 0
+      hm->dt[i] = hermite_block(hm, i, j > 0 ? HERMITE_ETA_START * a / j / tick
+                                             : T);
+    }
+  }
+  if (hm->shared) {
+    int smallest = T;
+    for (int i = 0; i < n; i++) {
+      smallest = hm->dt[i] < smallest ? hm->dt[i] : smallest;
+    }
+    for (int i = 0; i < n; i++) {
+      hm->dt[i] = smallest;
+    }
+  }
+  for (int now = 0; now < T;) {
+    int next = T;
+    for (int i = 0; i < n; i++) {
+      next = hm->t[i] + hm->dt[i] < next ? hm->t[i] + hm->dt[i] : next;
+    }
+    // predict every body to the block time, collect the due ones
+    hm->nact = 0;
+    for (int i = 0; i < n; i++) {
+      int k = i * v.stride;
+      double h = (next - hm->t[i]) * tick, h2 = h * h / 2, h3 = h2 * h / 3;
+      hm->px[i] = v.x[k] + h * v.vx[k] + h2 * hm->ax[i] + h3 * hm->jx[i];
+      hm->py[i] = v.y[k] + h * v.vy[k] + h2 * hm->ay[i] + h3 * hm->jy[i];
+      hm->pvx[i] = v.vx[k] + h * hm->ax[i] + h2 * hm->jx[i];
+      hm->pvy[i] = v.vy[k] + h * hm->ay[i] + h2 * hm->jy[i];
+      if (hm->t[i] + hm->dt[i] == next) {
+        hm->act[hm->nact++] = i;
+      }
+    }
+    Hermite_forces(ps);
+    for (int q = 0; q < hm->nact; q++) {
+      int i = hm->act[q], k = i * v.stride;
+      double h = hm->dt[i] * tick;
+      double a0[2] = {hm->ax[i], hm->ay[i]}, j0[2] = {hm->jx[i], hm->jy[i]};
+      double *a1 = hm->na + 2 * q, *j1 = hm->nj + 2 * q;
+      double *x[2] = {&v.x[k], &v.y[k]}, *u[2] = {&v.vx[k], &v.vy[k]};
+      double a2[2], a3[2];
+      for (int c = 0; c < 2; c++) { // corrector
+        double u1 = *u[c] + h / 2 * (a0[c] + a1[c]) +
+                    h * h / 12 * (j0[c] - j1[c]);
+        *x[c] += h / 2 * (*u[c] + u1) + h * h / 12 * (a0[c] - a1[c]);
+        *u[c] = u1;
+        a3[c] = (12 * (a0[c] - a1[c]) + 6 * h * (j0[c] + j1[c])) / (h * h * h);
+        a2[c] = (-6 * (a0[c] - a1[c]) - h * (4 * j0[c] + 2 * j1[c])) /
+                    (h * h) +
+                h * a3[c];
+      }
+      hm->ax[i] = a1[0];
+      hm->ay[i] = a1[1];
+      hm->jx[i] = j1[0];
+      hm->jy[i] = j1[1];
+      hm->t[i] = next;
+      double A = hypot(a1[0], a1[1]), J = hypot(j1[0], j1[1]);
+      double S = hypot(a2[0], a2[1]), K = hypot(a3[0], a3[1]);
+      double num = A * S + J * J, den = J * K + S * S;
+      hm->dt[i] = hermite_block(hm, i, den > 0 ? sqrt(HERMITE_ETA * num / den) /
+                                                     tick
+                                               : T);
+    }
+    hm->steps += hm->nact;
+    if (hm->shared) { // every body is active
+      int smallest = T;
+      for (int i = 0; i < n; i++) {
+        smallest = hm->dt[i] < smallest ? hm->dt[i] : smallest;
+      }
+      for (int i = 0; i < n; i++) {
+        hm->dt[i] = smallest;
+      }
+    }
+    now = next;
+  }
+  // the forces at the end of the frame are those of the last corrections
+  Kick *kk = &ps->kick;
+  if (ps->cap > kk->size) {
+    kk->size = ps->cap;
+    kk->f = realloc(kk->f, sizeof(VState) * ps->cap);
+  }
+  PSView f = PSystem_view_of(ps, kk->f);
+  for (int i = 0; i < n; i++) {
+    int k = i * v.stride;
+    f.x[k] = v.vx[k];
+    f.y[k] = v.vy[k];
+    f.vx[k] = hm->ax[i];
+    f.vy[k] = hm->ay[i];
+  }
+  kk->dirty = 0;
+  ps->stats.evals += (int)((hm->forces - forces + n / 2) / n);
+  return STEP;
+}
+
+// Advance the GSL stepper from ps->time to ps->time + STEP; *t is the time
+// reached within the frame. The last step is cut short to land on the frame
+// end, and the controller would then start the next frame from that cut
+// step; we keep its earlier proposal instead, unless the cut step itself
+// asked for less.
+int PSystem_evolve(PSystem *ps, double *t) {
+  gsl_odeiv2_driver *d = ps->driver;
+  double ta = ps->time, t1 = ps->time + STEP;
+  int o = GSL_SUCCESS;
+  while (ta < t1 && o == GSL_SUCCESS) {
+    double h = d->h, cut = t1 - ta;
+    o = gsl_odeiv2_evolve_apply(d->e, d->c, d->s, ps->sys, &ta, t1, &d->h,
+                                ps->state);
+    if (!ps->cold && ta == t1 && h > d->h && d->h >= 4.5 * cut) {
+      d->h = h; // the cut step only grew at the controller's limit
+    }
+  }
+  *t = ta - ps->time;
+  return o;
+}
+
+// Driver for the capacity and ps->stepper, replacing the old one
+void PSystem_driver(PSystem *ps) {
+  if (!ps->sys) {
+    ps->sys = calloc(1, sizeof(gsl_odeiv2_system));
+  }
+  ps->sys->function = func;
+  ps->sys->jacobian = jac;
+  ps->sys->dimension = ps->cap * 4;
+  ps->sys->params = ps;
+  if (ps->driver) {
+    gsl_odeiv2_driver_free(ps->driver);
+  }
+  ps->driver = gsl_odeiv2_driver_alloc_y_new(
+      ps->sys, stepper_type(ps->stepper), 1e-5, 1e-5, 0.0);
+  ps->driver_n = 0;
+}
+
+// Make room for n bodies, doubling the capacity: state (the free slots at
+// rest at the origin) and a driver of the new dimension. Dense steppers get
+// exactly n, which rebuilds their driver for every body added.
+void PSystem_reserve(PSystem *ps, int n) {
+  int exact = stepper_dense(ps->stepper);
+  if (exact ? n == ps->cap : n <= ps->cap) {
+    return;
+  }
+  int cap = exact ? n : ps->cap ? ps->cap : 16;
+  while (cap < n) {
+    cap *= 2;
+  }
+  double *s = calloc(cap, sizeof(VState));
+  if (ps->layout == PS_SOA) {
+    for (int c = 0; c < 4; c++) {
+      memcpy(s + c * cap, ps->state + c * ps->cap, sizeof(double) * ps->n);
+    }
+  } else {
+    memcpy(s, ps->state, sizeof(VState) * ps->n);
+  }
+  free(ps->state);
+  ps->state = s;
+  ps->cap = cap;
+  PSystem_driver(ps);
+}
+
+void PSystem_add(PSystem *ps, VState s) {
+  PSystem_reserve(ps, ps->n + 1);
+  ps->n += 1;
+  PSystem_set(ps, ps->n - 1, s);
+  ps->kick.dirty = 1;
+}
+
+// Reflect or wrap planets at the screen edges, depending on TOPOLOGY
+void PSystem_bound(PSystem *ps) {
+  PSView v = PSystem_view(ps);
+  Vector2 scr = scr2sim(V(screenWidth, screenHeight));
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    if (TOPOLOGY == 1) { // Torus, scr_mod rounds bodies that stay inside
+      if (fabs(v.x[k]) > fabs(scr.x) || fabs(v.y[k]) > fabs(scr.y)) {
+        v.x[k] = scr_mod(v.x[k], scr.x);
+        v.y[k] = scr_mod(v.y[k], scr.y);
+        ps->kick.dirty = 1;
+      }
+    } else if (Planet_reflect(v.x[k], v.y[k], &v.vx[k], &v.vy[k])) {
+      ps->kick.dirty = 1; // Reflecting Rectangle, breaks Hermite's jerks
+    }
+  }
+}
+
+void PSystem_step(PSystem *ps) {
+  if (!ps->n) {
+    return;
+  }
+  PSystem_select(ps);
+  StepStats *st = &ps->stats;
+  int evals = st->evals;
+  double t0 = wall_time(), t = 0; // time reached in this frame
+  int o = GSL_SUCCESS, rejected = st->rejected;
+  if (stepper_splitting(ps->stepper)) {
+    t = Symplectic_step(ps, stepper_splitting(ps->stepper));
+  } else if (ps->stepper == STEP_HERMITE) {
+    t = Hermite_step(ps);
+  } else if (ps->stepper == STEP_DOPRI5) {
+    long failed = ps->dopri.failed;
+    t = DOPRI5_step(ps);
+    o = t < STEP ? GSL_FAILURE : GSL_SUCCESS;
+    st->rejected += (int)(ps->dopri.failed - failed);
+  } else if (ps->stepper == STEP_ABM || ps->stepper == STEP_ABM_PEC) {
+    t = ABM_step(ps, ps->stepper == STEP_ABM);
+  } else if (stepper_rk_order(ps->stepper)) {
+    t = FixedRK_step(ps, stepper_rk_order(ps->stepper));
+    ps->kick.dirty = 1;
+  } else if (ps->stepper == STEP_JFNK) {
+    int failed = ps->jfnk.failed;
+    t = JFNK_step(ps);
+    o = t < STEP ? GSL_FAILURE : GSL_SUCCESS;
+    st->rejected += ps->jfnk.failed - failed;
+  } else {
+    if (ps->driver_n != ps->n) { // drop the history of multistep methods
+      gsl_odeiv2_driver_reset(ps->driver);
+      ps->driver_n = ps->n;
+    }
+    unsigned long failed = ps->driver->e->failed_steps;
+    if (ps->cold) {
+      if (ps->cold == 2) {
+        gsl_odeiv2_driver_reset_hstart(ps->driver, 1e-5);
+      }
+      o = gsl_odeiv2_driver_apply(ps->driver, &t, STEP, ps->state);
+    } else {
+      o = PSystem_evolve(ps, &t);
+    }
+    st->rejected += (int)(ps->driver->e->failed_steps - failed);
+    ps->kick.dirty = 1;
+  }
+  if (o != GSL_SUCCESS) {
+    printf("Simulation error at t=%.3f\n", ps->time + t);
+    exit(1);
+  }
+  ps->time += STEP;
+  PSystem_bound(ps);
+
+  st->step_time = wall_time() - t0;
+  st->step_evals = st->evals - evals;
+  st->step_rejected = st->rejected - rejected;
+  st->window_time = fmax(st->window_time, st->step_time);
+  st->window_evals =
+      st->window_evals > st->step_evals ? st->window_evals : st->step_evals;
+  if (++st->window_steps == FPS) {
+    st->worst_time = st->window_time;
+    st->worst_evals = st->window_evals;
+    st->window_steps = st->window_evals = 0;
+    st->window_time = 0;
+  }
+}
 
-  // INIT
+void PSystem_freeze(PSystem *ps, float s) {
+  PSView v = PSystem_view(ps);
   for (int i = 0; i < ps->n; i++) {
-    dydt[4 * i + 0] = y[4 * i + 1];
-    dydt[4 * i + 2] = y[4 * i + 3];
+    v.vx[i * v.stride] *= s;
+    v.vy[i * v.stride] *= s;
   }
+  ps->kick.dirty = 1;
+}
 
-  // Gravity towards center
-  float M = (float)GRAVITY / 100.0f;
+double PSystem_kinetic(PSystem *ps) {
+  PSView v = PSystem_view(ps);
+  double e = 0;
   for (int i = 0; i < ps->n; i++) {
-    double r3 = pow(pow(y[4 * i + 0], 2) + pow(y[4 * i + 2], 2), 3.f / 2.f);
-    if (r3 > 1e-6) {
-      dydt[4 * i + 1] += y[4 * i + 0] / r3 * (-1) * M;
-      dydt[4 * i + 3] += y[4 * i + 2] / r3 * (-1) * M;
-    }
+    int k = i * v.stride;
+    e += 0.5 * (v.vx[k] * v.vx[k] + v.vy[k] * v.vy[k]);
   }
+  return e;
+}
 
-  // Interactions
-  float C = 0.01 * INTERACTION;
-  if (C != 0) {
-    for (int i = 0; i < ps->n; i++) {
-      for (int j = 0; j < i; j++) {
-        if (i != j) {
-          double dx = y[4 * j + 0] - y[4 * i + 0]; // from i -> j
-          double dy = y[4 * j + 2] - y[4 * i + 2];
-          double r3 = pow(pow(dx, 2) + pow(dy, 2), 3.f / 2.f);
-          if (r3 > 1e-6) {
-            dydt[4 * i + 1] += C * dx / r3;
-            dydt[4 * i + 3] += C * dy / r3;
-            dydt[4 * j + 1] += -C * dx / r3;
-            dydt[4 * j + 3] += -C * dy / r3;
-          }
-        }
+// Kinetic plus potential energy of the direct force law: -M / r for the sun
+// and -C / r per pair, with r^2 softened by E2 as in the forces. Conserved
+// up to integration error, except with the periodic engines. O(n^2)
+double PSystem_energy(PSystem *ps) {
+  PSystem_select(ps);
+  PSView v = PSystem_view(ps);
+  double M = ps->M, C = ps->C, e2 = ps->E2, u = 0;
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    double xi = v.x[k], yi = v.y[k];
+    if (M != 0) {
+      u -= M / sqrt(xi * xi + yi * yi + e2);
+    }
+    for (int j = 0; C != 0 && j < i; j++) {
+      double dx = v.x[j * v.stride] - xi, dy = v.y[j * v.stride] - yi;
+      double r2 = dx * dx + dy * dy + e2;
+      if (r2 > 0) {
+        u -= C / sqrt(r2);
       }
     }
   }
-  return GSL_SUCCESS;
+  return PSystem_kinetic(ps) + u;
 }
 
-//
-// Vector Helpers
-
-
-
-//
-Vector2 V(float x, float y) {
-  Vector2 out;
-  out.x = x;
-  out.y = y;
-  return out;
+void PSystem_shock(PSystem *ps, float sigma) {
+  PSView v = PSystem_view(ps);
+  float e = sqrt(PSystem_kinetic(ps));
+  for (int i = 0; i < ps->n; i++) {
+    v.vx[i * v.stride] += gsl_ran_gaussian(rng, e * sigma);
+    v.vy[i * v.stride] += gsl_ran_gaussian(rng, e * sigma);
+  }
+  ps->kick.dirty = 1;
 }
 
-Vector2 Vsum(Vector2 a, Vector2 b) { return V(a.x + b.x, a.y + b.y); }
+void PSystem_center(PSystem *ps) {
+  PSView v = PSystem_view(ps);
+  float cx = 0, cy = 0, cvx = 0, cvy = 0;
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    cx += v.x[k];
+    cy += v.y[k];
+    cvx += v.vx[k];
+    cvy += v.vy[k];
+  }
+  cx = cx / ps->n;
+  cy = cy / ps->n;
+  cvx = cvx / ps->n;
+  cvy = cvy / ps->n;
+  printf("C %f %f\n", cvx, cvy);
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    v.x[k] -= cx;
+    v.y[k] -= cy;
+    v.vx[k] -= cvx;
+    v.vy[k] -= cvy;
+  }
+  ps->kick.dirty = 1;
+}
 
-Vector2 Vdiff(Vector2 a, Vector2 b) { return V(a.x - b.x, a.y - b.y); }
+float randf(float a) { return 2 * a * (float)rand() / (float)RAND_MAX - a; }
 
-Vector2 Vscale(Vector2 a, float s) { return V(a.x * s, a.y * s); }
 
-// Simulation coordinates around 0. Letter a,b
-Vector2 scr2sim(Vector2 P) {
-  float s = (float)SCALE * 20.f + 200;
-  return V((P.x - (float)screenWidth / 2) / s,
-           -(P.y - (float)screenHeight / 2) / s);
+void key_ctrl(int *x, int key) {
+  if (!IsKeyDown(key)) return;
+  if (IsKeyDown(KEY_LEFT_CONTROL)) {
+    *x = 0;
+    return;
+  }
+  int d = IsKeyDown(KEY_LEFT_SHIFT) ? -1 : 1;
+  *x += d;
+  if (*x < -100) {
+    *x = -100;
+  }
+  if (*x > 100) {
+    *x = 100;
+  }
 }
 
-Vector2 sim2scr(Vector2 a) {
-  float s = (float)SCALE * 20.f + 200;
-  return V((float)screenWidth / 2 + a.x * s, (float)screenHeight / 2 - a.y * s);
-}
 //
-// VTail
+// Simulation thread
+//
+// Physics runs on its own thread, one step of STEP per TICK of wall time
+// whatever the frame rate, and publishes a snapshot after every step
+// through a lock-free triple buffer: the writer fills its back slot and
+// swaps it with the middle one, the reader swaps the middle one with its
+// front slot when it holds a newer snapshot. Neither side waits for the
+// other, so a slow step does not stall input or vsync and a slow frame
+// does not slow the simulation. Frames draw the bodies interpolated
+// between the last two steps, one TICK behind. The UI changes the system
+// only through queued commands; the settings (GRAVITY, FORCE, ..) stay
+// ints of the stepping thread; the UI edits its copy UI and posts it, and
+// each step starts from the latest posted copy. Without pthreads (web
+// build) the render loop runs Sim_advance itself.
 //
 
-void VTail_print(VTail *t) {
-  printf("VTail<n=%d,fill=%d,data=%p>", t->n, t->fill, t->data);
+void Sim_post(Sim *sim, int type, int arg, VState s) {
+#ifdef HAVE_THREADS
+  pthread_mutex_lock(&sim->lock);
+#endif
+  if (sim->ncmds == sim->cmd_cap) {
+    sim->cmd_cap = sim->cmd_cap ? 2 * sim->cmd_cap : 16;
+    sim->cmds = realloc(sim->cmds, sizeof(Command) * sim->cmd_cap);
+  }
+  Command c = {type, arg, s};
+  sim->cmds[sim->ncmds++] = c;
+#ifdef HAVE_THREADS
+  pthread_mutex_unlock(&sim->lock);
+#endif
 }
 
-VTail *VTail_alloc(int n) {
-  VTail *t = calloc(1, sizeof(VTail));
-  t->n = n;
-  t->fill = 0;
-  t->data = calloc(n, sizeof(Vector2));
-  return t;
+// Settings for the next step on
+void Sim_configure(Sim *sim, const Settings *s) {
+#ifdef HAVE_THREADS
+  pthread_mutex_lock(&sim->lock);
+#endif
+  sim->settings = *s;
+  sim->configured = 1;
+#ifdef HAVE_THREADS
+  pthread_mutex_unlock(&sim->lock);
+#endif
 }
 
-void VTail_clear(VTail *t) { t->fill = 0; }
-
-void VTail_push(VTail *t, Vector2 a) {
-  if (t->n == 0) {
-    return;
+void Sim_apply(Sim *sim, Command *c) {
+  PSystem *ps = sim->ps;
+  switch (c->type) {
+  case CMD_ADD:
+    PSystem_add(ps, c->s);
+    break;
+  case CMD_SPAWN: {
+    float sigma = 1.2;
+    float v_sigma = 0.2;
+    Vector2 a = V(gsl_ran_gaussian(rng, sigma), gsl_ran_gaussian(rng, sigma));
+    Vector2 v =
+        V(gsl_ran_gaussian(rng, v_sigma), gsl_ran_gaussian(rng, v_sigma));
+    PSystem_add(ps, VState_new(a, v));
+    break;
   }
-  // advance elements in t.data
-  for (int tar = t->fill; tar > 0; tar--) {
-    int src = tar - 1;
-    if (src >= 0 && tar < t->n) {
-      t->data[tar] = t->data[src];
+  case CMD_RESET:
+    PSystem_free(ps);
+    sim->ps = PSystem_alloc();
+    sim->generation++;
+    sim->last_n = 0;
+    break;
+  case CMD_FREEZE:
+    PSystem_freeze(ps, 0.9);
+    break;
+  case CMD_SHOCK:
+    PSystem_shock(ps, 1.05);
+    break;
+  case CMD_CENTER:
+    PSystem_center(ps);
+    break;
+  case CMD_STEPPER:
+    ps->stepper = c->arg;
+    if (ps->n) {
+      int cap = ps->cap;
+      PSystem_reserve(ps, ps->n); // dense steppers drop the spare capacity
+      if (ps->cap == cap) {
+        PSystem_driver(ps);
+      }
     }
+    break;
   }
-  if (t->fill < t->n) {
-    t->fill += 1;
+}
+
+// Copy the system into the back slot and make it the middle one
+void Sim_publish(Sim *sim) {
+  PSystem *ps = sim->ps;
+  Snapshot *sn = &sim->slots[sim->back];
+  if (sn->size < ps->n) {
+    sn->size = ps->cap;
+    sn->pos = realloc(sn->pos, sizeof(Vector2) * sn->size);
+    sn->prev = realloc(sn->prev, sizeof(Vector2) * sn->size);
   }
-  t->data[0] = a;
+  if (sim->last_size < ps->n) {
+    sim->last_size = ps->cap;
+    sim->last = realloc(sim->last, sizeof(Vector2) * sim->last_size);
+  }
+  PSView v = PSystem_view(ps);
+  for (int i = 0; i < ps->n; i++) {
+    int k = i * v.stride;
+    sn->pos[i] = V(v.x[k], v.y[k]);
+    sn->prev[i] = i < sim->last_n ? sim->last[i] : sn->pos[i];
+  }
+  memcpy(sim->last, sn->pos, sizeof(Vector2) * ps->n);
+  sim->last_n = ps->n;
+  sn->n = ps->n;
+  sn->generation = sim->generation;
+  sn->steps = sim->steps;
+  sn->dropped = sim->dropped;
+  sn->time = ps->time;
+  sn->wall = sim->clock;
+  sn->kinetic = ps->n > 2000; // the potential is O(n^2)
+  sn->energy = sn->kinetic ? PSystem_kinetic(ps) : PSystem_energy(ps);
+  sn->stats = ps->stats;
+  sn->stepper = ps->stepper;
+  sn->threads = Pool_threads();
+  sn->rebuilds = ps->verlet.rebuilds;
+  sn->evals = ps->verlet.evals;
+  sn->rate = sim->rate;
+  sim->back = __atomic_exchange_n(&sim->middle, sim->back | SIM_FRESH,
+                                  __ATOMIC_ACQ_REL) &
+              3;
 }
 
-//
-// Planet
-//
+// The newest published snapshot, valid until the next call
+const Snapshot *Sim_latest(Sim *sim) {
+  if (__atomic_load_n(&sim->middle, __ATOMIC_ACQUIRE) & SIM_FRESH) {
+    sim->front =
+        __atomic_exchange_n(&sim->middle, sim->front, __ATOMIC_ACQ_REL) & 3;
+  }
+  return &sim->slots[sim->front];
+}
 
-Planet *Planet_alloc(Vector2 pos, Vector2 vel) {
-  Planet *p = calloc(1, sizeof(Planet));
-  p->state.x = pos.x;
-  p->state.y = pos.y;
-  p->state.vx = vel.x;
-  p->state.vy = vel.y;
-  p->tail = VTail_alloc(50);
-  p->color = MAROON;
-  return p;
+// One physics step: settings, queued commands, the step, the snapshot
+void Sim_tick(Sim *sim) {
+#ifdef HAVE_THREADS
+  pthread_mutex_lock(&sim->lock);
+#endif
+  if (sim->configured) {
+    Settings_set(&sim->settings);
+    sim->configured = 0;
+  }
+  for (int i = 0; i < sim->ncmds; i++) {
+    Sim_apply(sim, &sim->cmds[i]);
+  }
+  sim->ncmds = 0;
+#ifdef HAVE_THREADS
+  pthread_mutex_unlock(&sim->lock);
+#endif
+  PSystem_layout(sim->ps, LAYOUT);
+  PSystem_step(sim->ps);
+  sim->steps++;
+
+  double now = wall_time();
+  if (now - sim->rate_time >= 0.5) {
+    sim->rate = (sim->steps - sim->rate_steps) / (now - sim->rate_time);
+    sim->rate_time = now;
+    sim->rate_steps = sim->steps;
+  }
+  Sim_publish(sim);
+}
+
+// Run the steps due by wall time now, one per TICK since the last one. At
+// most SIM_MAX_TICKS are caught up; the rest of a longer backlog is
+// dropped, so steps slower than TICK slow the simulation down instead of
+// piling up.
+void Sim_advance(Sim *sim, double now) {
+  for (int k = 0; sim->clock + TICK <= now; k++) {
+    if (k == SIM_MAX_TICKS) {
+      long behind = (long)((now - sim->clock) / TICK);
+      sim->dropped += behind;
+      sim->clock += behind * TICK;
+      break;
+    }
+    sim->clock += TICK;
+    Sim_tick(sim);
+  }
 }
 
-void Planet_print(Planet *p) {
-  printf("Planet< %.3f + %.3f ; %.3f + %.3f >\n", p->state.x, p->state.vx,
-         p->state.y, p->state.vy);
+#ifdef HAVE_THREADS
+void *Sim_main(void *arg) {
+  Sim *sim = arg;
+  while (!__atomic_load_n(&sim->quit, __ATOMIC_ACQUIRE)) {
+    Sim_advance(sim, wall_time());
+    double wait = sim->clock + TICK - wall_time();
+    if (wait > 0) {
+      usleep((useconds_t)(1e6 * wait));
+    }
+  }
+  return NULL;
 }
+#endif
 
-Vector2 Planet_pos(Planet *p) { return V(p->state.x, p->state.y); }
+void Sim_start(Sim *sim) {
+  memset(sim, 0, sizeof(Sim));
+  sim->back = 0;
+  sim->middle = 1;
+  sim->front = 2;
+  sim->ps = PSystem_alloc();
+  sim->rate_time = sim->clock = wall_time();
+  Sim_publish(sim);
+#ifdef HAVE_THREADS
+  pthread_mutex_init(&sim->lock, NULL);
+  pthread_create(&sim->thread, NULL, Sim_main, sim);
+#endif
+}
 
-Vector2 Planet_vel(Planet *p) { return V(p->state.vx, p->state.vy); }
+void Sim_stop(Sim *sim) {
+#ifdef HAVE_THREADS
+  __atomic_store_n(&sim->quit, 1, __ATOMIC_RELEASE);
+  pthread_join(sim->thread, NULL);
+  pthread_mutex_destroy(&sim->lock);
+#endif
+  PSystem_free(sim->ps);
+  for (int k = 0; k < 3; k++) {
+    free(sim->slots[k].pos);
+    free(sim->slots[k].prev);
+  }
+  free(sim->last);
+  free(sim->cmds);
+}
 
-void Planet_reflect(Planet *p) {
-  if (sim2scr(Planet_pos(p)).x < 10) {
-    p->state.vx = -p->state.vx;
+// Match the planets to a snapshot, advancing the tails once per physics
+// step. The tails end at the previous positions, behind the drawn ones.
+void Scene_sync(Scene *sc, const Snapshot *sn) {
+  if (sc->generation != sn->generation) {
+    for (int i = 0; i < sc->n; i++) {
+      Planet_free(sc->planets[i]);
+    }
+    sc->n = 0;
+    sc->generation = sn->generation;
   }
-  if (sim2scr(Planet_pos(p)).y < 10) {
-    p->state.vy = -p->state.vy;
+  if (sn->n > sc->cap) {
+    sc->cap = sn->n > 2 * sc->cap ? sn->n : 2 * sc->cap;
+    sc->planets = realloc(sc->planets, sizeof(Planet *) * sc->cap);
   }
-  if (sim2scr(Planet_pos(p)).x > screenWidth - 10) {
-    p->state.vx = -p->state.vx;
+  while (sc->n < sn->n) {
+    sc->planets[sc->n++] = Planet_alloc();
   }
-  if (sim2scr(Planet_pos(p)).y > screenHeight - 10) {
-    p->state.vy = -p->state.vy;
+  if (sc->steps != sn->steps) {
+    for (int i = 0; i < sn->n; i++) {
+      VTail_push(sc->planets[i]->tail, sn->prev[i]);
+    }
+    sc->steps = sn->steps;
   }
 }
 
-double scr_mod(double x, double sz) {
-  sz = fabs(sz); // sz may be negative
-  double y = fmod(x + sz, 2 * sz) - sz;
-  // fix "quadrant"
-  while (y < -sz)
-    y += 2 * sz;
-  while (y > +sz)
-    y -= 2 * sz;
-  return y;
+// Draw the bodies as of wall time now - TICK, interpolated between the last
+// two steps. Bodies that wrapped around the torus are drawn where they are.
+void Scene_draw(Scene *sc, const Snapshot *sn, double now) {
+  float a = (now - sn->wall) / TICK;
+  a = a < 0 ? 0 : a > 1 ? 1 : a;
+  Vector2 half = scr2sim_of(&UI, V(UI.screenWidth, 0));
+  for (int i = 0; i < sn->n; i++) {
+    Vector2 p = sn->prev[i], q = sn->pos[i];
+    if (fabsf(q.x - p.x) < half.x && fabsf(q.y - p.y) < half.y) {
+      q = V(p.x + a * (q.x - p.x), p.y + a * (q.y - p.y));
+    }
+    Planet_draw(sc->planets[i], q);
+  }
 }
 
-void Planet_draw(Planet *p) {
-  Color c = BLUE;
-  if (INTERACTION < 0) {
-    c = MAROON;
-  }
-  float sz = 0.3f * abs(INTERACTION);
-  DrawCircleV(sim2scr(Planet_pos(p)), sz, c);
+//
+// Benchmarks: ./ray_planet bench [name] [n]
+//
 
-  VTail_push(p->tail, Planet_pos(p));
-  int n = p->tail->fill;
+// n bodies spawned as with KEY_S; the driver is left out
+PSystem *bench_system(int n, int layout) {
+  PSystem *ps = PSystem_alloc();
+  ps->n = n;
+  ps->cap = n;
+  ps->layout = layout;
+  ps->state = calloc(n, sizeof(VState));
   for (int i = 0; i < n; i++) {
-    float f = 1 - (float)i / (float)n;
-    DrawCircleV(sim2scr(p->tail->data[i]), 1, Fade(c, f));
+    Vector2 a = V(gsl_ran_gaussian(rng, 1.2), gsl_ran_gaussian(rng, 1.2));
+    Vector2 v = V(gsl_ran_gaussian(rng, 0.2), gsl_ran_gaussian(rng, 0.2));
+    PSystem_set(ps, i, VState_new(a, v));
   }
+  return ps;
 }
 
-void Planet_set(Planet *p, Vector2 pos, Vector2 vel) {
-  p->state.x = pos.x;
-  p->state.y = pos.y;
-  p->state.vx = vel.x;
-  p->state.vy = vel.y;
-  VTail_clear(p->tail);
+// With both force terms off func() is a pure streaming pass over the state;
+// bandwidth counts the 32 bytes read and 32 bytes written per body
+void bench_layout(int n) {
+  GRAVITY = 0;
+  INTERACTION = 0;
+  printf("%10s %12s %12s %12s %12s\n", "n", "aos ns/body", "aos GB/s",
+         "soa ns/body", "soa GB/s");
+  for (int m = 1000; m <= (n ? n : 1000000); m *= 10) {
+    printf("%10d", m);
+    for (int layout = PS_AOS; layout <= PS_SOA; layout++) {
+      PSystem *ps = bench_system(m, layout);
+      double *dydt = calloc(m, sizeof(VState));
+      int reps = 20000000 / m;
+      PSystem_select(ps);
+      func(0, ps->state, dydt, ps); // warm up scratch and caches
+      double t0 = wall_time();
+      for (int r = 0; r < reps; r++) {
+        func(0, ps->state, dydt, ps);
+      }
+      double dt = (wall_time() - t0) / reps / m;
+      printf(" %12.2f %12.2f", 1e9 * dt, 64 / dt / 1e9);
+      free(dydt);
+    }
+    printf("\n");
+  }
 }
 
-//
-// Planet System
-//
+// Speedup of the force engines over thread counts 1, 2, 4, .. up to the CPUs
+void bench_threads(int n) {
+  n = n ? n : 20000;
+  PSystem *ps = bench_system(n, PS_SOA);
+  double *dydt = calloc(n, sizeof(VState));
+  GRAVITY = 0;
+  INTERACTION = 10;
+  THREADS = 0;
+  int cpus = Pool_threads();
+  simd_select();
+  printf("n = %d, %d CPUs, %s kernel\n%12s %8s %10s %8s\n", n, cpus,
+         SIMD_NAME, "force", "threads", "ms/eval", "speedup");
+  for (FORCE = 0; FORCE < FORCE_MODES; FORCE++) {
+    double t1 = 0;
+    for (int t = 1; t <= cpus; t = t < cpus && 2 * t > cpus ? cpus : 2 * t) {
+      THREADS = t;
+      PSystem_select(ps);
+      func(0, ps->state, dydt, ps);
+      int reps = 0;
+      double t0 = wall_time(), dt;
+      do {
+        func(0, ps->state, dydt, ps);
+        reps++;
+      } while ((dt = wall_time() - t0) < 0.5);
+      dt /= reps;
+      t1 = t == 1 ? dt : t1;
+      printf("%12s %8d %10.2f %8.2f\n", FORCE_NAMES[FORCE], t, 1e3 * dt, t1 / dt);
+    }
+  }
+  FORCE = FORCE_DIRECT;
+  THREADS = 0;
+  free(dydt);
+}
 
-PSystem *PSystem_alloc() {
-  PSystem *ps = calloc(1, sizeof(PSystem));
+// Rate of the symmetric direct sweeps; a pair update counts PAIR_FLOPS
+// (sqrt and division taken as one flop each)
+#define PAIR_FLOPS 17
+
+void bench_tiled(int n) {
+  tiled_tune();
+  printf("Tiles: %d x %d\n", TILE_I, TILE_J);
+  GRAVITY = 0;
+  INTERACTION = 10;
+  printf("%10s %14s %14s\n", "n", "direct GF/s", "tiled GF/s");
+  for (int m = 1024; m <= (n ? n : 65536); m *= 2) {
+    PSystem *ps = bench_system(m, PS_SOA);
+    double *dydt = calloc(m, sizeof(VState));
+    printf("%10d", m);
+    int forces[] = {FORCE_DIRECT, FORCE_TILED};
+    for (int k = 0; k < 2; k++) {
+      FORCE = forces[k];
+      PSystem_select(ps);
+      func(0, ps->state, dydt, ps);
+      int reps = 0;
+      double t0 = wall_time(), dt;
+      do {
+        func(0, ps->state, dydt, ps);
+        reps++;
+      } while ((dt = wall_time() - t0) < 0.3);
+      printf(" %14.2f", PAIR_FLOPS * 0.5 * m * (m - 1) * reps / dt / 1e9);
+    }
+    printf("\n");
+    free(dydt);
+  }
+  FORCE = FORCE_DIRECT;
+}
+
+// n bodies spread uniformly over the torus of the default screen; forces
+// are unsoftened to compare with exact periodic sums
+PSystem *bench_torus(int n) {
+  PSystem *ps = bench_system(n, PS_SOA);
+  TOPOLOGY = 1;
+  SCALE = 0;
+  SOFTENING = 0;
+  double lx = screenWidth / 200.0, ly = screenHeight / 200.0;
+  for (int i = 0; i < n; i++) {
+    ps->state[i] = lx * (gsl_rng_uniform(rng) - 0.5);
+    ps->state[n + i] = ly * (gsl_rng_uniform(rng) - 0.5);
+  }
   return ps;
 }
 
-void PSystem_print(PSystem *ps) {
-  printf("PSystem<n=%d,state=[", ps->n);
-  for (int i = 0; i < ps->n; i++) {
-    printf("%.3f,", ps->state[i].x);
-    printf("%.3f,", ps->state[i].vx);
-    printf("%.3f,", ps->state[i].y);
-    printf("%.3f; ", ps->state[i].vy);
+// Accelerations of the current FORCE into ax, ay; returns seconds per
+// evaluation
+double bench_eval(PSystem *ps, double *ax, double *ay) {
+  int n = ps->n;
+  double *dydt = calloc(n, sizeof(VState));
+  PSystem_select(ps);
+  func(0, ps->state, dydt, ps);
+  int reps = 0;
+  double t0 = wall_time(), dt;
+  do {
+    func(0, ps->state, dydt, ps);
+    reps++;
+  } while ((dt = wall_time() - t0) < 0.3);
+  memcpy(ax, dydt + 2 * n, sizeof(double) * n);
+  memcpy(ay, dydt + 3 * n, sizeof(double) * n);
+  free(dydt);
+  return dt / reps;
+}
+
+// RMS error of (ax, ay) against (rx, ry) on every step-th body, relative
+// to the RMS force
+double bench_err(int n, int step, const double *ax, const double *ay,
+                 const double *rx, const double *ry) {
+  double e = 0, m = 0;
+  for (int i = 0; i < n; i += step) {
+    e += pow(ax[i] - rx[i], 2) + pow(ay[i] - ry[i], 2);
+    m += rx[i] * rx[i] + ry[i] * ry[i];
   }
-  printf("]>\n");
+  return sqrt(e / m);
 }
 
-void PSystem_add(PSystem *ps, Planet *p) {
-  ps->n += 1;
-  ps->planets = realloc(ps->planets, sizeof(Planet *) * ps->n);
-  ps->planets[ps->n - 1] = p;
+// Periodic reference forces: Ewald summation to 12 digits
+void bench_reference(PSystem *ps, double *rx, double *ry) {
+  int force = FORCE, digits = EWALD_DIGITS;
+  FORCE = FORCE_EWALD;
+  EWALD_DIGITS = 12;
+  bench_eval(ps, rx, ry);
+  FORCE = force;
+  EWALD_DIGITS = digits;
+}
 
-  ps->sys = calloc(1, sizeof(gsl_odeiv2_system));
-  ps->sys->function = func;
-  ps->sys->jacobian = NULL;
-  ps->sys->dimension = ps->n * 4;
-  ps->sys->params = ps;
-  ps->driver = gsl_odeiv2_driver_alloc_y_new(ps->sys, gsl_odeiv2_step_rk4, 1e-5,
-                                             1e-5, 0.0);
+// Time per evaluation and RMS error against Ewald summation for the mesh
+// solvers over mesh sizes and split radii. The open-space direct sum is
+// listed for its cost.
+void bench_p3m(int n) {
+  n = n ? n : 2000;
+  GRAVITY = 0;
+  INTERACTION = 100;
+  PSystem *ps = bench_torus(n);
+  double *rx = calloc(4 * n, sizeof(double));
+  double *ry = rx + n, *ax = rx + 2 * n, *ay = rx + 3 * n;
+  bench_reference(ps, rx, ry);
 
-  ps->state = realloc(ps->state, sizeof(VState) * ps->n);
-  ps->state[ps->n - 1] = VState0;
+  int grid = PM_GRID, split = P3M_SPLIT;
+  struct {
+    int force, grid, split;
+  } runs[] = {{FORCE_DIRECT, 0, 0}, {FORCE_PM, 7, 0},  {FORCE_PM, 9, 0},
+              {FORCE_P3M, 6, 40},   {FORCE_P3M, 6, 80}, {FORCE_P3M, 7, 20},
+              {FORCE_P3M, 7, 40},   {FORCE_P3M, 7, 80}, {FORCE_P3M, 8, 20},
+              {FORCE_P3M, 8, 40},   {FORCE_P3M, 9, 20}, {FORCE_P3M, 9, 40}};
+  printf("n = %d\n%14s %6s %6s %10s %10s\n", n, "force", "grid", "split",
+         "ms/eval", "rel err");
+  for (int r = 0; r < (int)(sizeof(runs) / sizeof(runs[0])); r++) {
+    FORCE = runs[r].force;
+    PM_GRID = runs[r].grid;
+    P3M_SPLIT = runs[r].split;
+    double dt = bench_eval(ps, ax, ay);
+    printf("%14s %6d %6d %10.2f %10.2e\n", FORCE_NAMES[FORCE], PM_GRID,
+           P3M_SPLIT, 1e3 * dt, bench_err(n, 1, ax, ay, rx, ry));
+  }
+  FORCE = FORCE_DIRECT;
+  TOPOLOGY = 0;
+  PM_GRID = grid;
+  P3M_SPLIT = split;
+  free(rx);
 }
 
-void PSystem_step(PSystem *ps) {
-  if (!ps->n) {
-    return;
+// Periodic force on body i by direct summation: for every other body the
+// sum over its images in a (2M + 1) x (2M lx / ly + 1) block of periods.
+// The truncation error is O(1/M).
+void bench_images(int n, const double *x, const double *y, int i, double lx,
+                  double ly, int M, double *fx, double *fy) {
+  int My = (int)ceil(M * lx / ly);
+  *fx = *fy = 0;
+  for (int j = 0; j < n; j++) {
+    double dx0 = x[j] - x[i], dy0 = y[j] - y[i];
+    dx0 -= lx * nearbyint(dx0 / lx);
+    dy0 -= ly * nearbyint(dy0 / ly);
+    for (int a = -M; a <= M; a++) {
+      for (int b = -My; b <= My; b++) {
+        double dx = dx0 + a * lx, dy = dy0 + b * ly;
+        double f = inv_r3(dx * dx + dy * dy);
+        *fx += dx * f;
+        *fy += dy * f;
+      }
+    }
   }
-  for (int i = 0; i < ps->n; i++) {
-    Planet *p = ps->planets[i];
-    ps->state[i] = p->state;
+}
+
+// Ewald summation over tolerances against the direct loop summed over
+// periodic images, plain and extrapolated from M and 2 M as 2 F(2M) - F(M).
+// The image sums run on every 32nd body and are timed per full evaluation.
+void bench_ewald(int n) {
+  n = n ? n : 1000;
+  GRAVITY = 0;
+  INTERACTION = 100;
+  PSystem *ps = bench_torus(n);
+  double *rx = calloc(6 * n, sizeof(double));
+  double *ry = rx + n, *ax = rx + 2 * n, *ay = rx + 3 * n;
+  double *bx = rx + 4 * n, *by = rx + 5 * n;
+  bench_reference(ps, rx, ry);
+
+  int digits = EWALD_DIGITS;
+  printf("n = %d\n%22s %10s %10s\n", n, "method", "ms/eval", "rel err");
+  FORCE = FORCE_EWALD;
+  for (EWALD_DIGITS = 2; EWALD_DIGITS <= 10; EWALD_DIGITS += 2) {
+    double dt = bench_eval(ps, ax, ay);
+    printf("%12s %2d digits %10.2f %10.2e\n", "ewald", EWALD_DIGITS, 1e3 * dt,
+           bench_err(n, 1, ax, ay, rx, ry));
   }
 
-  double t = 0;
-  int o = gsl_odeiv2_driver_apply(ps->driver, &t, STEP, (double *)ps->state);
-  if (o != GSL_SUCCESS) {
-    printf("Simulation error at t=%.3f\n", t);
-    exit(1);
+  const double *x = ps->state, *y = x + n;
+  double lx = screenWidth / 200.0, ly = screenHeight / 200.0, t1 = 0;
+  for (int M = 1; M <= 16; M *= 2) {
+    double t0 = wall_time();
+    for (int i = 0; i < n; i += 32) {
+      bench_images(n, x, y, i, lx, ly, M, &ax[i], &ay[i]);
+      ax[i] *= 0.01 * INTERACTION;
+      ay[i] *= 0.01 * INTERACTION;
+    }
+    double dt = (wall_time() - t0) * 32;
+    printf("%14s M = %2d %10.2f %10.2e\n", "images", M, 1e3 * dt,
+           bench_err(n, 32, ax, ay, rx, ry));
+    if (M > 1) {
+      for (int i = 0; i < n; i += 32) {
+        bx[i] = 2 * ax[i] - bx[i];
+        by[i] = 2 * ay[i] - by[i];
+      }
+      printf("%14s M = %2d %10.2f %10.2e\n", "extrapolated", M,
+             1e3 * (dt + t1), bench_err(n, 32, bx, by, rx, ry));
+    }
+    memcpy(bx, ax, sizeof(double) * n);
+    memcpy(by, ay, sizeof(double) * n);
+    t1 = dt;
   }
+  FORCE = FORCE_DIRECT;
+  TOPOLOGY = 0;
+  EWALD_DIGITS = digits;
+  free(rx);
+}
 
-  for (int i = 0; i < ps->n; i++) {
-    Planet *p = ps->planets[i];
-    p->state = ps->state[i];
-    if (TOPOLOGY == 1) { // Torus
-      Vector2 scr = scr2sim(V(screenWidth, screenHeight));
-      p->state.x = scr_mod(p->state.x, scr.x);
-      p->state.y = scr_mod(p->state.y, scr.y);
-    } else { // Reflecting Rectangle
-      Planet_reflect(p);
+// Frames of an attracting cloud with close encounters, run through the
+// adaptive driver as in the app, for a few softening lengths. Each length
+// gets at most 10 s, unsoftened runs may stall long before all frames.
+void bench_soft(int n) {
+  n = n ? n : 100;
+  int frames = 10 * FPS;
+  GRAVITY = 20;
+  INTERACTION = 20;
+  TOPOLOGY = 0;
+  FORCE = FORCE_DIRECT;
+  int softening = SOFTENING, lengths[] = {0, 1, 2, 5};
+  printf("n = %d\n%10s %8s %12s %12s %12s %12s\n", n, "softening", "frames",
+         "rhs/frame", "worst rhs", "ms/frame", "worst ms");
+  for (int k = 0; k < 4; k++) {
+    SOFTENING = lengths[k];
+    gsl_rng_set(rng, 1);
+    PSystem *ps = PSystem_alloc();
+    for (int i = 0; i < n; i++) {
+      Vector2 a = V(gsl_ran_gaussian(rng, 1.2), gsl_ran_gaussian(rng, 1.2));
+      Vector2 v = V(gsl_ran_gaussian(rng, 0.2), gsl_ran_gaussian(rng, 0.2));
+      PSystem_add(ps, VState_new(a, v));
     }
+    int worst_evals = 0, f;
+    double worst = 0, t0 = wall_time();
+    for (f = 0; f < frames && wall_time() - t0 < 10; f++) {
+      PSystem_step(ps);
+      worst = fmax(worst, ps->stats.step_time);
+      worst_evals = worst_evals > ps->stats.step_evals ? worst_evals
+                                                       : ps->stats.step_evals;
+    }
+    printf("%10.2f %8d %12.1f %12d %12.2f %12.2f\n", SOFTENING / 100.0, f,
+           (double)ps->stats.evals / f, worst_evals,
+           1e3 * (wall_time() - t0) / f, 1e3 * worst);
+    PSystem_free(ps);
   }
+  SOFTENING = softening;
 }
 
-void PSystem_draw(PSystem *ps) {
-  for (int i = 0; i < ps->n; i++) {
-    Planet_draw(ps->planets[i]);
+// Tight orbits around a heavy sun (GRAVITY 100) whose periods span two
+// orders of magnitude, through each GSL stepper for up to 2 s of simulated
+// time or 10 s of wall time
+void bench_stiff(int n) {
+  n = n ? n : 20;
+  int frames = 2 * FPS;
+  GRAVITY = 100;
+  INTERACTION = 10;
+  TOPOLOGY = 0;
+  FORCE = FORCE_DIRECT;
+  int stepper = STEPPER, softening = SOFTENING;
+  SOFTENING = 2;
+  printf("n = %d\n%8s %8s %10s %10s %10s %10s %10s\n", n, "stepper", "frames",
+         "steps/fr", "failed/fr", "rhs/fr", "jac/fr", "ms/frame");
+  for (STEPPER = 0; STEPPER < STEPPERS; STEPPER++) {
+    gsl_rng_set(rng, 1);
+    PSystem *ps = PSystem_alloc();
+    double e2 = pow(SOFTENING / 100.0, 2);
+    for (int i = 0; i < n; i++) {
+      double r = 0.05 * pow(10, (double)i / n), phi = 2 * M_PI * gsl_rng_uniform(rng);
+      double v = sqrt(r * r * inv_r3(r * r + e2)); // circular for M = 1
+      Vector2 a = V(r * cos(phi), r * sin(phi));
+      PSystem_add(ps, VState_new(a, V(-v * sin(phi), v * cos(phi))));
+    }
+    int f;
+    double t0 = wall_time();
+    for (f = 0; f < frames && wall_time() - t0 < 10; f++) {
+      PSystem_step(ps);
+    }
+    double steps = ps->driver->e->count, failed = ps->driver->e->failed_steps;
+    if (STEPPER == STEP_JFNK) {
+      steps = ps->jfnk.steps;
+      failed = ps->jfnk.failed;
+    } else if (STEPPER == STEP_DOPRI5) {
+      steps = ps->dopri.steps;
+      failed = ps->dopri.failed;
+    } else if (stepper_splitting(STEPPER) || stepper_rk_order(STEPPER) ||
+               STEPPER == STEP_ABM || STEPPER == STEP_ABM_PEC) {
+      steps = (double)SUBSTEPS * f;
+      failed = 0;
+    } else if (STEPPER == STEP_HERMITE) { // mean over the bodies
+      steps = (double)ps->hermite.steps / n;
+      failed = 0;
+    }
+    printf("%8s %8d %10.1f %10.1f %10.1f %10.1f %10.2f\n",
+           STEPPER_NAMES[STEPPER], f, steps / f, failed / f,
+           (double)ps->stats.evals / f, (double)ps->stats.jacobians / f,
+           1e3 * (wall_time() - t0) / f);
+    if (STEPPER == STEP_JFNK) {
+      printf("%8s %.1f Newton, %.1f GMRES iterations per frame\n", "",
+             (double)ps->jfnk.newton / f, (double)ps->jfnk.krylov / f);
+    } else if (STEPPER == STEP_ABM || STEPPER == STEP_ABM_PEC) {
+      printf("%8s mean order %.1f, %ld restarts\n", "",
+             (double)ps->abm.orders / ps->abm.steps, ps->abm.restarts);
+    }
+    PSystem_free(ps);
   }
+  STEPPER = stepper;
+  SOFTENING = softening;
 }
 
-void PSystem_freeze(PSystem *ps, float s) {
-  for (int i = 0; i < ps->n; i++) {
-    ps->planets[i]->state.vx *= s;
-    ps->planets[i]->state.vy *= s;
+// Energy error scene: bodies spawned as with KEY_S around a sun, softened
+// because fixed steps cannot resolve closer encounters
+void bench_energy_scene() {
+  GRAVITY = 40;
+  INTERACTION = 5;
+  SOFTENING = 10;
+  TOPOLOGY = 0;
+  FORCE = FORCE_DIRECT;
+}
+
+// Relative energy error of the scene with n bodies under STEPPER and
+// SUBSTEPS, over frames or 10 s of wall time
+void bench_energy_row(int n, int frames) {
+  gsl_rng_set(rng, 1);
+  PSystem *ps = PSystem_alloc();
+  for (int i = 0; i < n; i++) {
+    Vector2 a = V(gsl_ran_gaussian(rng, 1.2), gsl_ran_gaussian(rng, 1.2));
+    Vector2 v = V(gsl_ran_gaussian(rng, 0.2), gsl_ran_gaussian(rng, 0.2));
+    PSystem_add(ps, VState_new(a, v));
+  }
+  double e0 = PSystem_energy(ps), de = 0, worst = 0, t = 0;
+  int f;
+  for (f = 0; f < frames && t < 10; f++) {
+    double t0 = wall_time();
+    PSystem_step(ps);
+    t += wall_time() - t0;
+    de = fabs(PSystem_energy(ps) - e0) / fabs(e0);
+    worst = fmax(worst, de);
   }
+  printf("%11s %8d %8d %10.1f %12.2e %12.2e %10.2f\n", STEPPER_NAMES[STEPPER],
+         SUBSTEPS, f, (double)ps->stats.evals / f, de, worst, 1e3 * t / f);
+  PSystem_free(ps);
 }
 
-float PSystem_energy(PSystem *ps) {
-  float e = 0;
-  for (int i = 0; i < ps->n; i++) {
-    Planet *p = ps->planets[i];
-    e += 0.5 * pow(p->state.vx, 2), pow(p->state.vy, 2);
+void bench_energy_header(int n) {
+  printf("n = %d\n%11s %8s %8s %10s %12s %12s %10s\n", n, "stepper",
+         "substeps", "frames", "rhs/frame", "final dE/E", "max dE/E",
+         "ms/frame");
+}
+
+// rk4 under the GSL driver against leapfrog, over 100 time units (20 s of
+// frames)
+void bench_drift(int n) {
+  n = n ? n : 50;
+  int stepper = STEPPER, substeps = SUBSTEPS, softening = SOFTENING;
+  bench_energy_scene();
+  bench_energy_header(n);
+  STEPPER = STEP_RK4;
+  bench_energy_row(n, 20 * FPS);
+  STEPPER = STEP_LEAPFROG;
+  for (SUBSTEPS = 8; SUBSTEPS <= 64; SUBSTEPS *= 2) {
+    bench_energy_row(n, 20 * FPS);
   }
-  return e;
+  STEPPER = stepper;
+  SUBSTEPS = substeps;
+  SOFTENING = softening;
 }
 
-void PSystem_shock(PSystem *ps, float sigma) {
-  float e = sqrt(PSystem_energy(ps));
-  for (int i = 0; i < ps->n; i++) {
-    ps->planets[i]->state.vx += gsl_ran_gaussian(rng, e * sigma);
-    ps->planets[i]->state.vy += gsl_ran_gaussian(rng, e * sigma);
+// rk4 under the GSL driver against the fixed-step Runge-Kutta steppers, over
+// 100 time units
+void bench_fixed(int n) {
+  n = n ? n : 50;
+  int stepper = STEPPER, substeps = SUBSTEPS, softening = SOFTENING;
+  bench_energy_scene();
+  bench_energy_header(n);
+  STEPPER = STEP_RK4;
+  bench_energy_row(n, 20 * FPS);
+  for (STEPPER = STEP_RK2_FIXED; STEPPER <= STEP_RK4_FIXED; STEPPER++) {
+    for (SUBSTEPS = 2; SUBSTEPS <= 32; SUBSTEPS *= 2) {
+      bench_energy_row(n, 20 * FPS);
+    }
   }
+  STEPPER = stepper;
+  SUBSTEPS = substeps;
+  SOFTENING = softening;
 }
 
-void PSystem_center(PSystem *ps) {
-  float cx = 0, cy = 0, cvx = 0, cvy = 0;
-  for (int i = 0; i < ps->n; i++) {
-    cx += ps->planets[i]->state.x;
-    cy += ps->planets[i]->state.y;
-    cvx += ps->planets[i]->state.vx;
-    cvy += ps->planets[i]->state.vy;
+// Dormand-Prince against the GSL driver with rkf45 and rk8pd, at the same
+// absolute tolerance, over 100 time units of the scene of bench drift with
+// n and 4 n bodies
+void bench_dopri(int n) {
+  n = n ? n : 50;
+  int stepper = STEPPER, softening = SOFTENING;
+  int steppers[] = {STEP_RKF45, STEP_RK8PD, STEP_DOPRI5};
+  bench_energy_scene();
+  for (int m = n; m <= 4 * n; m *= 4) {
+    bench_energy_header(m);
+    for (int k = 0; k < 3; k++) {
+      STEPPER = steppers[k];
+      bench_energy_row(m, 20 * FPS);
+    }
   }
-  cx = cx / ps->n;
-  cy = cy / ps->n;
-  cvx = cvx / ps->n;
-  cvy = cvy / ps->n;
-  printf("C %f %f\n", cvx, cvy);
-  for (int i = 0; i < ps->n; i++) {
-    ps->planets[i]->state.x -= cx;
-    ps->planets[i]->state.y -= cy;
-    ps->planets[i]->state.vx -= cvx;
-    ps->planets[i]->state.vy -= cvy;
+  STEPPER = stepper;
+  SOFTENING = softening;
+}
+
+// Adams-Bashforth-Moulton against rk4 under the GSL driver and Dormand-
+// Prince, over 100 time units of the scene of bench drift, whose bodies
+// reflect at the screen margin
+void bench_abm(int n) {
+  n = n ? n : 50;
+  int stepper = STEPPER, substeps = SUBSTEPS, softening = SOFTENING;
+  bench_energy_scene();
+  bench_energy_header(n);
+  STEPPER = STEP_RK4;
+  bench_energy_row(n, 20 * FPS);
+  STEPPER = STEP_DOPRI5;
+  bench_energy_row(n, 20 * FPS);
+  for (STEPPER = STEP_ABM; STEPPER <= STEP_ABM_PEC; STEPPER++) {
+    for (SUBSTEPS = 8; SUBSTEPS <= 64; SUBSTEPS *= 2) {
+      bench_energy_row(n, 20 * FPS);
+    }
   }
+  STEPPER = stepper;
+  SUBSTEPS = substeps;
+  SOFTENING = softening;
 }
 
-float randf(float a) { return 2 * a * (float)rand() / (float)RAND_MAX - a; }
+// Energy error against force evaluations for each splitting, over 100 time
+// units
+void bench_symplectic(int n) {
+  n = n ? n : 50;
+  int stepper = STEPPER, substeps = SUBSTEPS, softening = SOFTENING;
+  bench_energy_scene();
+  bench_energy_header(n);
+  for (STEPPER = STEP_LEAPFROG; stepper_splitting(STEPPER); STEPPER++) {
+    for (SUBSTEPS = 4; SUBSTEPS <= 64; SUBSTEPS *= 2) {
+      bench_energy_row(n, 20 * FPS);
+    }
+  }
+  STEPPER = stepper;
+  SUBSTEPS = substeps;
+  SOFTENING = softening;
+}
+
+// n bodies on circular orbits of radius 0.5 to 2 around a heavy sun, every
+// 50th on an eccentric one grazing it at 0.05; Hermite with individual
+// block steps against one shared step, over 15 time units
+void bench_block(int n) {
+  n = n ? n : 100;
+  int frames = 3 * FPS;
+  int stepper = STEPPER, softening = SOFTENING;
+  GRAVITY = 100;
+  INTERACTION = 1;
+  SOFTENING = 1;
+  TOPOLOGY = 0;
+  FORCE = FORCE_DIRECT;
+  STEPPER = STEP_HERMITE;
+  printf("n = %d\n%8s %8s %12s %10s %12s %10s\n", n, "steps", "frames",
+         "forces/fr", "rhs/frame", "max dE/E", "ms/frame");
+  for (int shared = 0; shared < 2; shared++) {
+    gsl_rng_set(rng, 1);
+    PSystem *ps = PSystem_alloc();
+    ps->hermite.shared = shared;
+    for (int i = 0; i < n; i++) {
+      double r = 0.5 + 1.5 * gsl_rng_uniform(rng), v = 1 / sqrt(r);
+      if (i % 50 == 0) { // apocenter 1.5, pericenter 0.05
+        r = 1.5;
+        v = sqrt(2 * 0.05 / (r * (r + 0.05)));
+      }
+      double phi = 2 * M_PI * gsl_rng_uniform(rng);
+      Vector2 a = V(r * cos(phi), r * sin(phi));
+      PSystem_add(ps, VState_new(a, V(-v * sin(phi), v * cos(phi))));
+    }
+    double e0 = PSystem_energy(ps), worst = 0, t = 0;
+    int f;
+    for (f = 0; f < frames && t < 10; f++) {
+      double t0 = wall_time();
+      PSystem_step(ps);
+      t += wall_time() - t0;
+      worst = fmax(worst, fabs(PSystem_energy(ps) - e0) / fabs(e0));
+    }
+    printf("%8s %8d %12.1f %10.1f %12.2e %10.2f\n",
+           shared ? "shared" : "block", f, (double)ps->hermite.forces / f,
+           (double)ps->stats.evals / f, worst, 1e3 * t / f);
+    PSystem_free(ps);
+  }
+  STEPPER = stepper;
+  SOFTENING = softening;
+}
 
+// GSL steppers on the energy scene: restarted every frame from the initial
+// step (cold), through gsl_odeiv2_driver_apply from t = 0 (driver), or on
+// the simulation clock with the step carried over (warm)
+void bench_warm(int n) {
+  n = n ? n : 50;
+  int frames = 10 * FPS;
+  int stepper = STEPPER, softening = SOFTENING;
+  const char *starts[] = {"warm", "driver", "cold"};
+  bench_energy_scene();
+  printf("n = %d\n%8s %6s %8s %10s %12s %10s %10s\n", n, "stepper", "start",
+         "frames", "steps/fr", "rejected/fr", "rhs/frame", "ms/frame");
+  for (STEPPER = STEP_RK4; STEPPER <= STEP_RK8PD; STEPPER++) {
+    for (int cold = 2; cold >= 0; cold--) {
+      gsl_rng_set(rng, 1);
+      PSystem *ps = PSystem_alloc();
+      ps->cold = cold;
+      for (int i = 0; i < n; i++) {
+        Vector2 a = V(gsl_ran_gaussian(rng, 1.2), gsl_ran_gaussian(rng, 1.2));
+        Vector2 v = V(gsl_ran_gaussian(rng, 0.2), gsl_ran_gaussian(rng, 0.2));
+        PSystem_add(ps, VState_new(a, v));
+      }
+      int f;
+      double t0 = wall_time();
+      for (f = 0; f < frames && wall_time() - t0 < 10; f++) {
+        PSystem_step(ps);
+      }
+      printf("%8s %6s %8d %10.1f %12.1f %10.1f %10.2f\n",
+             STEPPER_NAMES[STEPPER], starts[cold], f,
+             (double)ps->driver->e->count / f, (double)ps->stats.rejected / f,
+             (double)ps->stats.evals / f, 1e3 * (wall_time() - t0) / f);
+      PSystem_free(ps);
+    }
+  }
+  STEPPER = stepper;
+  SOFTENING = softening;
+}
 
-void key_ctrl(int *x, int key) {
-  if (!IsKeyDown(key)) return;
-  if (IsKeyDown(KEY_LEFT_CONTROL)) {
-    *x = 0;
-    return;
+// Bulk add n planets as KEY_S does: time per add and peak resident memory
+// per planet at each decade should stay flat
+void bench_add(int n) {
+  n = n ? n : 100000;
+  PSystem *ps = PSystem_alloc();
+  printf("%10s %10s %10s %14s\n", "planets", "capacity", "ns/add",
+         "KB/planet");
+  double t0 = wall_time();
+  for (int i = 0, last = 0, decade = 10; i < n; i++) {
+    Vector2 a = V(gsl_ran_gaussian(rng, 1.2), gsl_ran_gaussian(rng, 1.2));
+    Vector2 v = V(gsl_ran_gaussian(rng, 0.2), gsl_ran_gaussian(rng, 0.2));
+    PSystem_add(ps, VState_new(a, v));
+    if (i + 1 == decade || i + 1 == n) {
+      double t = wall_time(), kb = 0;
+#ifndef PLATFORM_WEB
+      struct rusage ru;
+      getrusage(RUSAGE_SELF, &ru);
+      kb = (double)ru.ru_maxrss / (i + 1);
+#endif
+      printf("%10d %10d %10.1f %14.3f\n", i + 1, ps->cap,
+             1e9 * (t - t0) / (i + 1 - last), kb);
+      t0 = t;
+      last = i + 1;
+      decade *= 10;
+    }
   }
-  int d = IsKeyDown(KEY_LEFT_SHIFT) ? -1 : 1;
-  *x += d;
-  if (*x < -100) {
-    *x = -100;
+  PSystem_free(ps);
+}
+
+int bench(int argc, char **argv) {
+  struct {
+    const char *name;
+    void (*run)(int n);
+  } benches[] = {
+      {"layout", bench_layout},
+      {"threads", bench_threads},
+      {"tiled", bench_tiled},
+      {"p3m", bench_p3m},
+      {"ewald", bench_ewald},
+      {"soft", bench_soft},
+      {"stiff", bench_stiff},
+      {"drift", bench_drift},
+      {"fixed", bench_fixed},
+      {"dopri", bench_dopri},
+      {"abm", bench_abm},
+      {"symplectic", bench_symplectic},
+      {"block", bench_block},
+      {"add", bench_add},
+      {"warm", bench_warm},
+  };
+  const char *name = argc > 0 ? argv[0] : NULL;
+  int n = argc > 1 ? atoi(argv[1]) : 0;
+  rng = gsl_rng_alloc(gsl_rng_taus);
+  int found = 0;
+  for (int k = 0; k < (int)(sizeof(benches) / sizeof(benches[0])); k++) {
+    if (!name || strcmp(name, benches[k].name) == 0) {
+      printf("== %s\n", benches[k].name);
+      benches[k].run(n);
+      found = 1;
+    }
   }
-  if (*x > 100) {
-    *x = 100;
+  if (!found) {
+    printf("unknown benchmark %s\n", name);
+    return 1;
   }
+  return 0;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return bench(argc - 2, argv + 2);
+  }
+
   // SetConfigFlags(FLAG_WINDOW_RESIZABLE);
   SetConfigFlags(FLAG_VSYNC_HINT);
 
@@ -387,8 +4768,12 @@ int main(void) {
   // SetTargetFPS(FPS);
   rng = gsl_rng_alloc(gsl_rng_taus);
 
-  // Simulation State
-  PSystem *ps = PSystem_alloc();
+  // Simulation State; the globals are the physics thread's from here on
+  Settings_get(&UI);
+  Settings posted = UI;
+  Sim sim;
+  Sim_start(&sim);
+  Scene scene = {0};
 
   // UI state
   int select = 0;
@@ -397,88 +4782,127 @@ int main(void) {
   {
     if (IsKeyReleased(KEY_F)) {
       int monitor = GetCurrentMonitor();
-      screenHeight = GetMonitorHeight(monitor);
-      screenWidth = GetMonitorWidth(monitor);
-      SetWindowSize(screenWidth, screenHeight);
-      printf("S SZ %d %d\n", screenWidth, screenHeight);
+      UI.screenHeight = GetMonitorHeight(monitor);
+      UI.screenWidth = GetMonitorWidth(monitor);
+      SetWindowSize(UI.screenWidth, UI.screenHeight);
+      printf("S SZ %d %d\n", UI.screenWidth, UI.screenHeight);
       ToggleFullscreen();
     }
 
-    screenWidth = GetScreenWidth();
-    screenHeight = GetScreenHeight();
+    UI.screenWidth = GetScreenWidth();
+    UI.screenHeight = GetScreenHeight();
 
     BeginDrawing();
     ClearBackground(BLACK);
 
     if (IsWindowResized()) {
-      screenWidth = GetScreenWidth();
-      screenHeight = GetScreenHeight();
+      UI.screenWidth = GetScreenWidth();
+      UI.screenHeight = GetScreenHeight();
     }
 
     // Daraw Margin
-    DrawRectangleLines(10, 10, screenWidth - 20, screenHeight - 20, RAYWHITE);
+    DrawRectangleLines(10, 10, UI.screenWidth - 20, UI.screenHeight - 20,
+                       RAYWHITE);
 
     // Draw Sun
     Color s_color;
-    float s_size = 5 * GRAVITY / 10.0f;;
-    if (GRAVITY > 0) {
+    float s_size = 5 * UI.GRAVITY / 10.0f;;
+    if (UI.GRAVITY > 0) {
       s_color = YELLOW;
     } else {
       s_color = MAROON;
       s_size *= -1;
     }
-    DrawCircleV(sim2scr(V(0, 0)), s_size, s_color);
+    DrawCircleV(sim2scr_of(&UI, V(0, 0)), s_size, s_color);
 
 
-    key_ctrl(&GRAVITY, KEY_ONE);
-    key_ctrl(&INTERACTION, KEY_TWO);
-    key_ctrl(&SCALE, KEY_THREE);
+    key_ctrl(&UI.GRAVITY, KEY_ONE);
+    key_ctrl(&UI.INTERACTION, KEY_TWO);
+    key_ctrl(&UI.SCALE, KEY_THREE);
+    key_ctrl(force_param(&UI), KEY_FOUR);
+    key_ctrl(&UI.THREADS, KEY_FIVE);
+    key_ctrl(&UI.SOFTENING, KEY_SIX);
+    key_ctrl(&UI.SUBSTEPS, KEY_SEVEN);
+    if (IsKeyPressed(KEY_M))
+      UI.FORCE = (UI.FORCE + 1) % FORCE_MODES;
+    if (IsKeyPressed(KEY_L))
+      UI.LAYOUT = UI.LAYOUT == PS_AOS ? PS_SOA : PS_AOS;
+    if (IsKeyPressed(KEY_I)) {
+      UI.STEPPER = (UI.STEPPER + 1) % STEPPERS;
+      Sim_post(&sim, CMD_STEPPER, UI.STEPPER, VState0);
+    }
+    if (memcmp(&UI, &posted, sizeof(Settings))) {
+      Sim_configure(&sim, &UI);
+      posted = UI;
+    }
     if (IsKeyPressed(KEY_NINE))
-      PSystem_shock(ps, 1.05);
+      Sim_post(&sim, CMD_SHOCK, 0, VState0);
     if (IsKeyDown(KEY_ZERO))
-      PSystem_freeze(ps, 0.9);
+      Sim_post(&sim, CMD_FREEZE, 0, VState0);
 
     if (IsKeyReleased(KEY_C)) {
-      PSystem_center(ps);
+      Sim_post(&sim, CMD_CENTER, 0, VState0);
     }
 
     if (IsKeyReleased(KEY_Q)) {
       CloseWindow();
     }
     if (IsKeyReleased(KEY_R)) {
-      ps = PSystem_alloc();
+      Sim_post(&sim, CMD_RESET, 0, VState0);
     }
     if (IsKeyPressed(KEY_S)) {
-      float sigma = 1.2;
-      float v_sigma = 0.2;
-      Vector2 a = V(gsl_ran_gaussian(rng, sigma), gsl_ran_gaussian(rng, sigma));
-      Vector2 v =
-          V(gsl_ran_gaussian(rng, v_sigma), gsl_ran_gaussian(rng, v_sigma));
-      PSystem_add(ps, Planet_alloc(a, v));
+      Sim_post(&sim, CMD_SPAWN, 0, VState0);
     }
     if (!select && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
       mousePos0 = GetMousePosition();
       select = 1;
     } else if (select && IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-      Vector2 a = scr2sim(mousePos0);
-      Vector2 b = scr2sim(GetMousePosition());
-      PSystem_add(ps, Planet_alloc(a, Vdiff(b, a)));
+      Vector2 a = scr2sim_of(&UI, mousePos0);
+      Vector2 b = scr2sim_of(&UI, GetMousePosition());
+      Sim_post(&sim, CMD_ADD, 0, VState_new(a, Vdiff(b, a)));
       select = 0;
     }
     if (select) {
       DrawCircleV(mousePos0, 2, MAROON);
       DrawLineV(mousePos0, GetMousePosition(), MAROON);
     }
-    PSystem_step(ps);
-    PSystem_draw(ps);
+#ifndef HAVE_THREADS
+    Sim_advance(&sim, wall_time());
+#endif
+    const Snapshot *sn = Sim_latest(&sim);
+    Scene_sync(&scene, sn);
+    Scene_draw(&scene, sn, wall_time());
 
     DrawFPS(15, 15);
-    DrawText(TextFormat("%2g Energy", PSystem_energy(ps)), 15, 35, 20, GREEN);
+    DrawText(TextFormat("%.0f steps/s, t = %.1f, %ld steps dropped",
+                        sn->rate, sn->time, sn->dropped),
+             120, 15, 20, GREEN);
+    DrawText(TextFormat(sn->kinetic ? "%2g Kinetic energy" : "%2g Energy",
+                        sn->energy),
+             15, 35, 20, GREEN);
+    DrawText(TextFormat("%d planets, %s force (%d), %s, %d threads", sn->n,
+                        FORCE_NAMES[UI.FORCE], *force_param(&UI),
+                        UI.LAYOUT == PS_SOA ? "soa" : "aos", sn->threads),
+             15, 55, 20, GREEN);
+    DrawText(TextFormat("%s (%d substeps), softening %.2f, %d rhs/step "
+                        "(worst %d), %d rejected, %.1f ms/step (worst %.1f)",
+                        STEPPER_NAMES[sn->stepper], UI.SUBSTEPS,
+                        UI.SOFTENING / 100.0, sn->stats.step_evals,
+                        sn->stats.worst_evals, sn->stats.step_rejected,
+                        1e3 * sn->stats.step_time,
+                        1e3 * sn->stats.worst_time),
+             15, 75, 20, GREEN);
+    if (UI.FORCE == FORCE_VERLET) {
+      DrawText(TextFormat("%d list rebuilds in %d evaluations", sn->rebuilds,
+                          sn->evals),
+               15, 95, 20, GREEN);
+    }
     EndDrawing();
   }
 
   // De-Initialization
   //--------------------------------------------------------------------------------------
+  Sim_stop(&sim);
   CloseWindow(); // Close window and OpenGL context
   //--------------------------------------------------------------------------------------
 